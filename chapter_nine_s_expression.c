@@ -1,5 +1,13 @@
 #include "mpc.h"
-#include <math.h>
+#include <limits.h>
+#include <stdint.h>
+
+/* Large sub-expressions can be evaluated on threads, see Parallel Evaluation */
+#if !defined(_WIN32) && defined(__GNUC__)
+#define LPOOL_THREADS
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 #ifdef _WIN32
 
@@ -32,21 +40,52 @@ typedef struct mpc_ast_t {
  * */
 struct lval;
 typedef struct lval lval;
+typedef struct lbig lbig;
 typedef struct lval {
   int type;
   long num;
+  /* Numbers too large for a long*/
+  lbig *big;
   /* Errors and Symbol types have some string data*/
   char *err;
   char *sym;
+  /* Symbols are interned: sym is shared and id indexes the symbol table */
+  int id;
   /* Count and Pointer to a list of  "lval"*/
   int count;
   lval **cell;
+  /* Number of cells allocated, which doubles when full*/
+  int slots;
+  /* Nodes in this S-expression's tree, counted as it is read*/
+  int size;
 } lval;
 
-enum { LVAL_NUM, LVAL_ERR, LVAL_SYM, LVAL_SEXPR };
+enum { LVAL_NUM, LVAL_ERR, LVAL_SYM, LVAL_SEXPR, LVAL_BIG };
 enum { LERR_DIV_ZERO, LERR_BAD_OP, LERR_BAD_NUM };
 
+/*
+ * Numbers which fit are carried in the lval pointer itself, shifted
+ * up one bit with the low bit set, so they need no allocation. An
+ * lval allocated by malloc is always aligned so its low bit is clear.
+ * Larger numbers are boxed as before. Use lval_type and lval_to_num
+ * rather than reading type and num directly.
+ */
+
+#define LVAL_IMM_MAX (INTPTR_MAX >> 1)
+#define LVAL_IMM_MIN (INTPTR_MIN >> 1)
+
+int lval_is_imm(lval *v) { return ((uintptr_t)v & 1) != 0; }
+
+int lval_type(lval *v) { return lval_is_imm(v) ? LVAL_NUM : v->type; }
+
+long lval_to_num(lval *v) {
+  return lval_is_imm(v) ? (long)((intptr_t)v >> 1) : v->num;
+}
+
 lval *lval_num(long x) {
+  if (x >= LVAL_IMM_MIN && x <= LVAL_IMM_MAX) {
+    return (lval *)(((uintptr_t)(intptr_t)x << 1) | 1);
+  }
   lval *v = malloc(sizeof(lval));
   v->type = LVAL_NUM;
   v->num = x;
@@ -61,11 +100,358 @@ lval *lval_err(char *m) {
   return v;
 }
 
+/*
+ * Big Integers
+ *
+ * Integers that do not fit in a long are kept as a sign and a
+ * magnitude of 32 bit digits, least significant first, with no
+ * leading zero digits. Zero has no digits. Every operation returns a
+ * fresh lbig and leaves its arguments alone.
+ */
+
+struct lbig {
+  int neg;
+  int n;
+  uint32_t d[];
+};
+
+/* Results of ^ past this many bits are refused rather than computed */
+#define LBIG_MAX_BITS (1L << 20)
+
+lbig *lbig_alloc(int n) {
+  lbig *a = malloc(sizeof(lbig) + sizeof(uint32_t) * (n ? n : 1));
+  a->neg = 0;
+  a->n = n;
+  return a;
+}
+
+lbig *lbig_trim(lbig *a) {
+  while (a->n > 0 && a->d[a->n - 1] == 0) { a->n--; }
+  if (a->n == 0) { a->neg = 0; }
+  return a;
+}
+
+lbig *lbig_from_long(long x) {
+  unsigned long m = x < 0 ? 0UL - (unsigned long)x : (unsigned long)x;
+  lbig *a = lbig_alloc(sizeof(unsigned long) / sizeof(uint32_t));
+  for (int i = 0; i < a->n; ++i) {
+    a->d[i] = (uint32_t)m;
+    m = (m >> 16) >> 16;
+  }
+  a->neg = x < 0;
+  return lbig_trim(a);
+}
+
+/* Writes the value to x and returns 1 if it fits in a long */
+int lbig_to_long(const lbig *a, long *x) {
+  if (a->n > (int)(sizeof(unsigned long) / sizeof(uint32_t))) { return 0; }
+  unsigned long m = 0;
+  for (int i = a->n - 1; i >= 0; --i) { m = ((m << 16) << 16) | a->d[i]; }
+  if (!a->neg && m <= (unsigned long)LONG_MAX) { *x = (long)m; return 1; }
+  if (a->neg && m <= (unsigned long)LONG_MAX + 1) {
+    *x = m == (unsigned long)LONG_MAX + 1 ? LONG_MIN : -(long)m;
+    return 1;
+  }
+  return 0;
+}
+
+lbig *lbig_copy(const lbig *a) {
+  lbig *b = lbig_alloc(a->n);
+  b->neg = a->neg;
+  memcpy(b->d, a->d, sizeof(uint32_t) * a->n);
+  return b;
+}
+
+long lbig_bits(const lbig *a) {
+  if (a->n == 0) { return 0; }
+  long bits = (long)(a->n - 1) * 32;
+  for (uint32_t top = a->d[a->n - 1]; top; top >>= 1) { bits++; }
+  return bits;
+}
+
+int lbig_cmp_mag(const lbig *a, const lbig *b) {
+  if (a->n != b->n) { return a->n < b->n ? -1 : 1; }
+  for (int i = a->n - 1; i >= 0; --i) {
+    if (a->d[i] != b->d[i]) { return a->d[i] < b->d[i] ? -1 : 1; }
+  }
+  return 0;
+}
+
+int lbig_cmp(const lbig *a, const lbig *b) {
+  if (a->neg != b->neg) { return a->neg ? -1 : 1; }
+  int c = lbig_cmp_mag(a, b);
+  return a->neg ? -c : c;
+}
+
+/* |a| + |b| */
+lbig *lbig_add_mag(const lbig *a, const lbig *b) {
+  if (a->n < b->n) { const lbig *t = a; a = b; b = t; }
+  lbig *r = lbig_alloc(a->n + 1);
+  uint64_t carry = 0;
+  for (int i = 0; i < a->n; ++i) {
+    carry += (uint64_t)a->d[i] + (i < b->n ? b->d[i] : 0);
+    r->d[i] = (uint32_t)carry;
+    carry >>= 32;
+  }
+  r->d[a->n] = (uint32_t)carry;
+  return lbig_trim(r);
+}
+
+/* |a| - |b|, where |a| >= |b| */
+lbig *lbig_sub_mag(const lbig *a, const lbig *b) {
+  lbig *r = lbig_alloc(a->n);
+  uint32_t borrow = 0;
+  for (int i = 0; i < a->n; ++i) {
+    uint64_t y = (uint64_t)(i < b->n ? b->d[i] : 0) + borrow;
+    borrow = a->d[i] < y;
+    r->d[i] = (uint32_t)(a->d[i] - y);
+  }
+  return lbig_trim(r);
+}
+
+/* a + b, or a - b when sub is set */
+lbig *lbig_add(const lbig *a, const lbig *b, int sub) {
+  int bneg = b->neg ^ sub;
+  lbig *r;
+  if (a->neg == bneg) {
+    r = lbig_add_mag(a, b);
+    r->neg = a->neg;
+  } else if (lbig_cmp_mag(a, b) >= 0) {
+    r = lbig_sub_mag(a, b);
+    r->neg = a->neg;
+  } else {
+    r = lbig_sub_mag(b, a);
+    r->neg = bneg;
+  }
+  return lbig_trim(r);
+}
+
+lbig *lbig_mul(const lbig *a, const lbig *b) {
+  lbig *r = lbig_alloc(a->n + b->n);
+  memset(r->d, 0, sizeof(uint32_t) * r->n);
+  for (int i = 0; i < a->n; ++i) {
+    uint64_t carry = 0;
+    for (int j = 0; j < b->n; ++j) {
+      carry += (uint64_t)a->d[i] * b->d[j] + r->d[i + j];
+      r->d[i + j] = (uint32_t)carry;
+      carry >>= 32;
+    }
+    r->d[i + b->n] = (uint32_t)carry;
+  }
+  r->neg = a->neg ^ b->neg;
+  return lbig_trim(r);
+}
+
+/*
+ * Truncating division as C does it: the quotient rounds toward zero
+ * and the remainder takes the sign of a. Either result may be NULL
+ * if unwanted. b must not be zero.
+ */
+void lbig_divmod(const lbig *a, const lbig *b, lbig **q, lbig **r) {
+  lbig *qq = lbig_alloc(a->n);
+  memset(qq->d, 0, sizeof(uint32_t) * qq->n);
+  lbig *rr;
+
+  if (b->n == 1) {
+    /* Short division by a single digit */
+    uint64_t rem = 0;
+    for (int i = a->n - 1; i >= 0; --i) {
+      rem = (rem << 32) | a->d[i];
+      qq->d[i] = (uint32_t)(rem / b->d[0]);
+      rem %= b->d[0];
+    }
+    rr = lbig_alloc(1);
+    rr->d[0] = (uint32_t)rem;
+  } else {
+    /* One bit at a time, the remainder never needs more than b->n + 1 digits */
+    int m = b->n + 1;
+    rr = lbig_alloc(m);
+    memset(rr->d, 0, sizeof(uint32_t) * m);
+    for (long i = (long)a->n * 32 - 1; i >= 0; --i) {
+      uint32_t c = (a->d[i / 32] >> (i % 32)) & 1;
+      for (int k = 0; k < m; ++k) {
+        uint32_t top = rr->d[k] >> 31;
+        rr->d[k] = (rr->d[k] << 1) | c;
+        c = top;
+      }
+      int ge = 1;
+      for (int k = m - 1; k >= 0; --k) {
+        uint32_t bk = k < b->n ? b->d[k] : 0;
+        if (rr->d[k] != bk) { ge = rr->d[k] > bk; break; }
+      }
+      if (ge) {
+        uint32_t borrow = 0;
+        for (int k = 0; k < m; ++k) {
+          uint64_t y = (uint64_t)(k < b->n ? b->d[k] : 0) + borrow;
+          borrow = rr->d[k] < y;
+          rr->d[k] = (uint32_t)(rr->d[k] - y);
+        }
+        qq->d[i / 32] |= (uint32_t)1 << (i % 32);
+      }
+    }
+  }
+
+  qq->neg = a->neg ^ b->neg;
+  rr->neg = a->neg;
+  if (q) { *q = lbig_trim(qq); } else { free(qq); }
+  if (r) { *r = lbig_trim(rr); } else { free(rr); }
+}
+
+/* Exponentiation by squaring */
+lbig *lbig_pow(const lbig *x, unsigned long e) {
+  lbig *r = lbig_from_long(1);
+  lbig *b = lbig_copy(x);
+  while (e) {
+    if (e & 1) {
+      lbig *t = lbig_mul(r, b);
+      free(r);
+      r = t;
+    }
+    e >>= 1;
+    if (e) {
+      lbig *t = lbig_mul(b, b);
+      free(b);
+      b = t;
+    }
+  }
+  free(b);
+  return r;
+}
+
+/* Reads an optional '-' and decimal digits up to end */
+lbig *lbig_from_str(const char *s, const char *end) {
+  int neg = *s == '-';
+  if (neg) { s++; }
+  lbig *a = lbig_alloc((int)((end - s) / 9 + 2));
+  a->n = 0;
+  while (s < end) {
+    /* Nine digits at a time, so each step is one multiply and add */
+    uint32_t chunk = 0, scale = 1;
+    for (int i = 0; i < 9 && s < end; ++i, ++s) {
+      chunk = chunk * 10 + (uint32_t)(*s - '0');
+      scale *= 10;
+    }
+    uint64_t carry = chunk;
+    for (int i = 0; i < a->n; ++i) {
+      carry += (uint64_t)a->d[i] * scale;
+      a->d[i] = (uint32_t)carry;
+      carry >>= 32;
+    }
+    if (carry) { a->d[a->n++] = (uint32_t)carry; }
+  }
+  a->neg = neg;
+  return lbig_trim(a);
+}
+
+void lbig_print(const lbig *a) {
+  if (a->n == 0) { putchar('0'); return; }
+
+  /* Peel off nine decimal digits at a time from a scratch copy */
+  uint32_t *t = malloc(sizeof(uint32_t) * a->n);
+  uint32_t *chunks = malloc(sizeof(uint32_t) * (a->n * 2 + 1));
+  memcpy(t, a->d, sizeof(uint32_t) * a->n);
+  int n = a->n, count = 0;
+  do {
+    uint64_t rem = 0;
+    for (int i = n - 1; i >= 0; --i) {
+      rem = (rem << 32) | t[i];
+      t[i] = (uint32_t)(rem / 1000000000);
+      rem %= 1000000000;
+    }
+    chunks[count++] = (uint32_t)rem;
+    while (n > 0 && t[n - 1] == 0) { n--; }
+  } while (n > 0);
+
+  if (a->neg) { putchar('-'); }
+  printf("%u", (unsigned)chunks[--count]);
+  while (count > 0) { printf("%09u", (unsigned)chunks[--count]); }
+  free(chunks);
+  free(t);
+}
+
+/* Takes ownership of a, which must not fit in a long */
+lval *lval_big(lbig *a) {
+  lval *v = malloc(sizeof(lval));
+  v->type = LVAL_BIG;
+  v->big = a;
+  return v;
+}
+
+int lval_is_num(lval *v) {
+  int t = lval_type(v);
+  return t == LVAL_NUM || t == LVAL_BIG;
+}
+
+/*
+ * Symbols
+ *
+ * Every symbol name is kept once in a global table and known by its
+ * index. The builtin operators are interned first so their ids are
+ * fixed and index the builtin table directly.
+ */
+
+enum { LSYM_ADD, LSYM_SUB, LSYM_MUL, LSYM_DIV, LSYM_MOD, LSYM_POW, LSYM_MIN, LSYM_MAX, LSYM_BUILTINS };
+
+static const char *lsym_builtins[LSYM_BUILTINS] = { "+", "-", "*", "/", "%", "^", "min", "max" };
+
+static char **lsym_names;
+static int lsym_count;
+static int *lsym_table;
+static int lsym_slots;
+
+unsigned long lsym_hash(const char *s) {
+  unsigned long h = 5381;
+  while (*s) { h = h * 33 + (unsigned char)*s++; }
+  return h;
+}
+
+int lsym_intern(const char *s);
+
+void lsym_grow(void) {
+  lsym_slots = lsym_slots ? lsym_slots * 2 : 64;
+  free(lsym_table);
+  lsym_table = malloc(sizeof(int) * lsym_slots);
+  for (int i = 0; i < lsym_slots; ++i) { lsym_table[i] = -1; }
+  for (int i = 0; i < lsym_count; ++i) {
+    unsigned long j = lsym_hash(lsym_names[i]) & (lsym_slots - 1);
+    while (lsym_table[j] != -1) { j = (j + 1) & (lsym_slots - 1); }
+    lsym_table[j] = i;
+  }
+}
+
+int lsym_intern(const char *s) {
+  if (lsym_slots == 0) {
+    lsym_grow();
+    for (int i = 0; i < LSYM_BUILTINS; ++i) { lsym_intern(lsym_builtins[i]); }
+  }
+  unsigned long j = lsym_hash(s) & (lsym_slots - 1);
+  while (lsym_table[j] != -1) {
+    if (strcmp(lsym_names[lsym_table[j]], s) == 0) { return lsym_table[j]; }
+    j = (j + 1) & (lsym_slots - 1);
+  }
+  lsym_names = realloc(lsym_names, sizeof(char *) * (lsym_count + 1));
+  lsym_names[lsym_count] = malloc(strlen(s) + 1);
+  strcpy(lsym_names[lsym_count], s);
+  lsym_table[j] = lsym_count++;
+  if (lsym_count * 2 > lsym_slots) { lsym_grow(); }
+  return lsym_count - 1;
+}
+
+void lsym_clear(void) {
+  for (int i = 0; i < lsym_count; ++i) { free(lsym_names[i]); }
+  free(lsym_names);
+  free(lsym_table);
+  lsym_names = NULL;
+  lsym_table = NULL;
+  lsym_count = 0;
+  lsym_slots = 0;
+}
+
 lval *lval_sym(char *s) {
   lval *v = malloc(sizeof(lval));
   v->type = LVAL_SYM;
-  v->sym = malloc(strlen(s) + 1);
-  strcpy(v->sym, s);
+  v->id = lsym_intern(s);
+  v->sym = lsym_names[v->id];
   return v;
 }
 
@@ -74,18 +460,35 @@ lval *lval_sexpr() {
   v->type = LVAL_SEXPR;
   v->count = 0;
   v->cell = NULL;
+  v->slots = 0;
+  v->size = 1;
+  return v;
+}
+
+int lval_size(lval *v) {
+  return lval_type(v) == LVAL_SEXPR ? v->size : 1;
+}
+
+/* An empty S-expression with room for n cells, when the count is known */
+lval *lval_sexpr_sized(int n) {
+  lval *v = lval_sexpr();
+  v->cell = n ? malloc(sizeof(lval *) * n) : NULL;
+  v->slots = n;
   return v;
 }
 
 void lval_del(lval *v) {
+  if (lval_is_imm(v)) { return; }
   switch (v->type) {
   case LVAL_NUM:
     break;
+  case LVAL_BIG:
+    free(v->big);
+    break;
   case LVAL_ERR:
     free(v->err);
     break;
   case LVAL_SYM:
-    free(v->sym);
     break;
   case LVAL_SEXPR:
     for (int i = 0; i < v->count; ++i) {
@@ -108,9 +511,12 @@ void lval_expr_print(lval *v, char open, char close) {
   putchar(close);
 }
 void lval_print(lval *v) {
-  switch (v->type) {
+  switch (lval_type(v)) {
   case LVAL_NUM:
-    printf("%li", v->num);
+    printf("%li", lval_to_num(v));
+    break;
+  case LVAL_BIG:
+    lbig_print(v->big);
     break;
   case LVAL_ERR:
     printf("Error %s", v->err);
@@ -134,12 +540,209 @@ void lval_println(lval *v) {
 lval *lval_eval(lval *v);
 lval *lval_take(lval *v, int i);
 lval *lval_pop(lval *v, int i);
-lval *builtin_op(lval *v, char* c);
+lval *builtin_op(lval *v, int id);
 lval *lval_eval_sexpr(lval *v);
 
+/*
+ * Parallel Evaluation
+ *
+ * Builtins are pure, so the children of an S-expression can be
+ * evaluated at the same time. When lpool_start has been given more
+ * than one thread, a child whose subtree holds at least LPOOL_GRAIN
+ * nodes, as counted by lval_add while reading, is forked as a task
+ * and joined before the operator is applied. Smaller children are
+ * evaluated in place, as they always were.
+ *
+ * Each thread keeps its own deque of tasks. It pushes and pops its
+ * own tasks at the bottom, and an idle thread steals the oldest task
+ * from the top of another's. A thread waiting on a join runs tasks
+ * too, so it is never idle while work is left.
+ */
+
+enum { LPOOL_GRAIN = 4096 };
+
+typedef struct ltask {
+  lval *v;
+  lval *(*f)(lval *);
+  int index;
+  int done;
+} ltask;
+
+#if defined(LPOOL_THREADS)
+
+/* Tasks waiting to run are tasks[top] to tasks[bottom - 1] */
+typedef struct {
+  pthread_mutex_t lock;
+  ltask **tasks;
+  int top;
+  int bottom;
+  int slots;
+} ldeque;
+
+static ldeque *lpool_deques;
+static pthread_t *lpool_threads;
+static int lpool_count;
+static int lpool_pending;
+static int lpool_stopping;
+static pthread_mutex_t lpool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lpool_wake = PTHREAD_COND_INITIALIZER;
+static __thread int lpool_self;
+
+void ldeque_push(ldeque *d, ltask *t) {
+  pthread_mutex_lock(&d->lock);
+  if (d->bottom == d->slots) {
+    if (d->top > 0) {
+      memmove(d->tasks, d->tasks + d->top, sizeof(ltask *) * (d->bottom - d->top));
+      d->bottom -= d->top;
+      d->top = 0;
+    } else {
+      d->slots = d->slots ? d->slots * 2 : 16;
+      d->tasks = realloc(d->tasks, sizeof(ltask *) * d->slots);
+    }
+  }
+  d->tasks[d->bottom++] = t;
+  pthread_mutex_unlock(&d->lock);
+}
+
+/* The owner takes its newest task, a thief the oldest */
+ltask *ldeque_take(ldeque *d, int steal) {
+  ltask *t = NULL;
+  pthread_mutex_lock(&d->lock);
+  if (d->top < d->bottom) { t = steal ? d->tasks[d->top++] : d->tasks[--d->bottom]; }
+  pthread_mutex_unlock(&d->lock);
+  return t;
+}
+
+ltask *lpool_take(void) {
+  ltask *t = ldeque_take(&lpool_deques[lpool_self], 0);
+  for (int k = 1; !t && k < lpool_count; ++k) {
+    t = ldeque_take(&lpool_deques[(lpool_self + k) % lpool_count], 1);
+  }
+  if (t) { __atomic_sub_fetch(&lpool_pending, 1, __ATOMIC_RELAXED); }
+  return t;
+}
+
+void lpool_run(ltask *t) {
+  t->v = t->f(t->v);
+  __atomic_store_n(&t->done, 1, __ATOMIC_RELEASE);
+}
+
+void lpool_fork(ltask *t) {
+  ldeque_push(&lpool_deques[lpool_self], t);
+  pthread_mutex_lock(&lpool_lock);
+  __atomic_add_fetch(&lpool_pending, 1, __ATOMIC_RELAXED);
+  pthread_cond_signal(&lpool_wake);
+  pthread_mutex_unlock(&lpool_lock);
+}
+
+void lpool_join(ltask *t) {
+  while (!__atomic_load_n(&t->done, __ATOMIC_ACQUIRE)) {
+    ltask *u = lpool_take();
+    if (u) { lpool_run(u); } else { sched_yield(); }
+  }
+}
+
+void *lpool_worker(void *self) {
+  lpool_self = (int)(intptr_t)self;
+  while (1) {
+    ltask *t = lpool_take();
+    if (t) { lpool_run(t); continue; }
+
+    /* Sleep until a task is forked somewhere, or the pool stops */
+    pthread_mutex_lock(&lpool_lock);
+    while (__atomic_load_n(&lpool_pending, __ATOMIC_RELAXED) == 0 && !lpool_stopping) {
+      pthread_cond_wait(&lpool_wake, &lpool_lock);
+    }
+    int stop = lpool_stopping;
+    pthread_mutex_unlock(&lpool_lock);
+    if (stop) { return NULL; }
+  }
+}
+
+/* The calling thread is the first of the n */
+void lpool_start(int n) {
+  if (n <= 1 || lpool_count > 0) { return; }
+  lpool_count = n;
+  lpool_deques = calloc(n, sizeof(ldeque));
+  lpool_threads = malloc(sizeof(pthread_t) * n);
+  for (int i = 0; i < n; ++i) {
+    pthread_mutex_init(&lpool_deques[i].lock, NULL);
+  }
+  for (int i = 1; i < n; ++i) {
+    pthread_create(&lpool_threads[i], NULL, lpool_worker, (void *)(intptr_t)i);
+  }
+}
+
+void lpool_stop(void) {
+  if (lpool_count == 0) { return; }
+  pthread_mutex_lock(&lpool_lock);
+  lpool_stopping = 1;
+  pthread_cond_broadcast(&lpool_wake);
+  pthread_mutex_unlock(&lpool_lock);
+  for (int i = 1; i < lpool_count; ++i) {
+    pthread_join(lpool_threads[i], NULL);
+  }
+  for (int i = 0; i < lpool_count; ++i) {
+    pthread_mutex_destroy(&lpool_deques[i].lock);
+    free(lpool_deques[i].tasks);
+  }
+  free(lpool_deques);
+  free(lpool_threads);
+  lpool_count = 0;
+  lpool_stopping = 0;
+}
+
+#else
+
+/* Without threads everything is evaluated in place */
+static int lpool_count;
+
+void lpool_start(int n) { (void)n; }
+void lpool_stop(void) {}
+void lpool_fork(ltask *t) { (void)t; }
+void lpool_join(ltask *t) { t->v = t->f(t->v); }
+
+#endif
+
+/* Replaces every cell of v with f of it, forking the large ones */
+void lval_eval_cells(lval *v, lval *(*f)(lval *)) {
+  int forks = 0;
+  for (int i = 0; lpool_count > 1 && i < v->count; ++i) {
+    if (lval_size(v->cell[i]) >= LPOOL_GRAIN) { forks++; }
+  }
+
+  if (forks == 0) {
+    for (int i = 0; i < v->count; ++i) {
+      v->cell[i] = f(v->cell[i]);
+    }
+    return;
+  }
+
+  ltask *tasks = malloc(sizeof(ltask) * forks);
+  int n = 0;
+  for (int i = 0; i < v->count; ++i) {
+    if (lval_size(v->cell[i]) < LPOOL_GRAIN) { continue; }
+    tasks[n] = (ltask){ v->cell[i], f, i, 0 };
+    /* The task owns the cell until it is joined */
+    v->cell[i] = NULL;
+    lpool_fork(&tasks[n++]);
+  }
+  for (int i = 0; i < v->count; ++i) {
+    if (v->cell[i]) { v->cell[i] = f(v->cell[i]); }
+  }
+
+  /* Newest first, so a task nobody stole is still at the bottom of our deque */
+  while (n > 0) {
+    ltask *t = &tasks[--n];
+    lpool_join(t);
+    v->cell[t->index] = t->v;
+  }
+  free(tasks);
+}
+
 lval *lval_eval(lval* v) {
     /* evaluate Sexpressions */
-    if (v->type == LVAL_SEXPR) {
+    if (lval_type(v) == LVAL_SEXPR) {
         return lval_eval_sexpr(v);
     }
 
@@ -148,14 +751,12 @@ lval *lval_eval(lval* v) {
 }
 
 lval *lval_eval_sexpr(lval* v) {
-    /* Evalutate Children*/
-    for (int i = 0; i < v->count; ++i) {
-        v->cell[i] = lval_eval(v->cell[i]);
-    }
+    /* Evalutate Children, large ones in parallel when the pool is running*/
+    lval_eval_cells(v, lval_eval);
 
     /*Error checking*/
     for (int i = 0; i < v->count; ++i) {
-        if (v->cell[i]->type == LVAL_ERR) {
+        if (lval_type(v->cell[i]) == LVAL_ERR) {
             return lval_take(v, i);
         }
     }
@@ -169,17 +770,13 @@ lval *lval_eval_sexpr(lval* v) {
     }
 
     /* Ensure first element is Symbol*/
-    lval *f = lval_pop(v, 0);
-    if (f->type != LVAL_SYM) {
-        lval_del(f);
+    if (lval_type(v->cell[0]) != LVAL_SYM) {
         lval_del(v);
         return lval_err("S-expression does not start with symbol!");
     }
 
-    /* Call Builtin with operator*/
-    lval*  result = builtin_op(v, f->sym);
-    lval_del(f);
-    return result;
+    /* Call Builtin with operator, it takes the whole expression*/
+    return builtin_op(v, v->cell[0]->id);
 }
 
 lval *lval_pop(lval* v, int i) {
@@ -189,126 +786,466 @@ lval *lval_pop(lval* v, int i) {
     /* Shift memory after the item at "i" over the top*/
     memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count - i - 1));
 
-    /* Decrease the count of items in the list */
+    /* Decrease the count of items in the list, keeping the memory for reuse */
     v->count--;
-
-    /* Reallocate the momory used*/
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
     return x;
 }
 
 lval *lval_take(lval*v, int i) {
-    lval* x = lval_pop(v, i);
+    /* The rest is deleted anyway so fill the gap from the end instead of shifting*/
+    lval* x = v->cell[i];
+    v->cell[i] = v->cell[--v->count];
     lval_del(v);
     return x;
 }
 
-lval* builtin_op(lval* a, char* op) {
+/*
+ * Numbers
+ *
+ * Arithmetic runs on longs and checks each step for overflow. A step
+ * that overflows is redone on big integers, and the fold carries on
+ * there; the result drops back to a long if it fits. So a value is a
+ * big integer only when it is out of the range of a long.
+ */
+
+typedef struct {
+  long num;
+  /* Set when the value does not fit in num */
+  lbig *big;
+} lnum;
+
+/* Returned by a builtin when its result does not fit in a long */
+static const char lnum_overflow[] = "Integer overflow!";
+
+int lnum_add_overflow(long x, long y, long *r) {
+#if defined(__GNUC__)
+  return __builtin_add_overflow(x, y, r);
+#else
+  if ((y > 0 && x > LONG_MAX - y) || (y < 0 && x < LONG_MIN - y)) { return 1; }
+  *r = x + y;
+  return 0;
+#endif
+}
+
+int lnum_sub_overflow(long x, long y, long *r) {
+#if defined(__GNUC__)
+  return __builtin_sub_overflow(x, y, r);
+#else
+  if ((y < 0 && x > LONG_MAX + y) || (y > 0 && x < LONG_MIN + y)) { return 1; }
+  *r = x - y;
+  return 0;
+#endif
+}
+
+int lnum_mul_overflow(long x, long y, long *r) {
+#if defined(__GNUC__)
+  return __builtin_mul_overflow(x, y, r);
+#else
+  if (x > 0 ? (y > 0 ? x > LONG_MAX / y : y < LONG_MIN / x)
+            : (y > 0 ? x < LONG_MIN / y : x != 0 && y < LONG_MAX / x)) {
+    return 1;
+  }
+  *r = x * y;
+  return 0;
+#endif
+}
+
+/*
+ * Builtins fold one more argument into the running result and
+ * return an error message, or NULL. They are indexed by symbol id.
+ * The long ones leave x alone and return lnum_overflow when the
+ * result would not fit, and the big ones are used instead.
+ */
+
+typedef const char *(*lbuiltin)(long *x, long y);
+
+const char *builtin_add(long *x, long y) {
+  long r;
+  if (lnum_add_overflow(*x, y, &r)) { return lnum_overflow; }
+  *x = r;
+  return NULL;
+}
+
+const char *builtin_sub(long *x, long y) {
+  long r;
+  if (lnum_sub_overflow(*x, y, &r)) { return lnum_overflow; }
+  *x = r;
+  return NULL;
+}
+
+const char *builtin_mul(long *x, long y) {
+  long r;
+  if (lnum_mul_overflow(*x, y, &r)) { return lnum_overflow; }
+  *x = r;
+  return NULL;
+}
+
+const char *builtin_min(long *x, long y) { if (y < *x) { *x = y; } return NULL; }
+const char *builtin_max(long *x, long y) { if (y > *x) { *x = y; } return NULL; }
+
+const char *builtin_div(long *x, long y) {
+  if (y == 0) { return "Division by zero!"; }
+  if (*x == LONG_MIN && y == -1) { return lnum_overflow; }
+  *x /= y;
+  return NULL;
+}
+
+const char *builtin_mod(long *x, long y) {
+  if (y == 0) { return "Division by zero!"; }
+  *x = y == -1 ? 0 : *x % y;
+  return NULL;
+}
+
+/* A negative power is 1 / x^-y truncated, which is only nonzero for 1 and -1 */
+const char *builtin_pow(long *x, long y) {
+  if (y < 0) {
+    if (*x == 0) { return "Division by zero!"; }
+    *x = *x == 1 || *x == -1 ? (y % 2 == 0 ? 1 : *x) : 0;
+    return NULL;
+  }
+  long r = 1, b = *x;
+  while (y) {
+    if ((y & 1) && lnum_mul_overflow(r, b, &r)) { return lnum_overflow; }
+    y >>= 1;
+    if (y && lnum_mul_overflow(b, b, &b)) { return lnum_overflow; }
+  }
+  *x = r;
+  return NULL;
+}
+
+static lbuiltin builtins[LSYM_BUILTINS] = {
+  builtin_add, builtin_sub, builtin_mul, builtin_div,
+  builtin_mod, builtin_pow, builtin_min, builtin_max
+};
+
+typedef const char *(*lbigop)(lbig **x, const lbig *y);
+
+const char *bigop_set(lbig **x, lbig *r) {
+  free(*x);
+  *x = r;
+  return NULL;
+}
+
+const char *bigop_add(lbig **x, const lbig *y) { return bigop_set(x, lbig_add(*x, y, 0)); }
+const char *bigop_sub(lbig **x, const lbig *y) { return bigop_set(x, lbig_add(*x, y, 1)); }
+const char *bigop_mul(lbig **x, const lbig *y) { return bigop_set(x, lbig_mul(*x, y)); }
+
+const char *bigop_min(lbig **x, const lbig *y) {
+  return lbig_cmp(y, *x) < 0 ? bigop_set(x, lbig_copy(y)) : NULL;
+}
+
+const char *bigop_max(lbig **x, const lbig *y) {
+  return lbig_cmp(y, *x) > 0 ? bigop_set(x, lbig_copy(y)) : NULL;
+}
+
+const char *bigop_div(lbig **x, const lbig *y) {
+  if (y->n == 0) { return "Division by zero!"; }
+  lbig *q;
+  lbig_divmod(*x, y, &q, NULL);
+  return bigop_set(x, q);
+}
+
+const char *bigop_mod(lbig **x, const lbig *y) {
+  if (y->n == 0) { return "Division by zero!"; }
+  lbig *r;
+  lbig_divmod(*x, y, NULL, &r);
+  return bigop_set(x, r);
+}
+
+const char *bigop_pow(lbig **x, const lbig *y) {
+  long b, e;
+  int odd = y->n > 0 && (y->d[0] & 1);
+
+  /* 0, 1 and -1 stay small whatever the power */
+  if (lbig_to_long(*x, &b) && b >= -1 && b <= 1) {
+    if (b == 0 && y->neg) { return "Division by zero!"; }
+    if (b == 0) { b = y->n == 0; }
+    if (b == -1 && !odd) { b = 1; }
+    return bigop_set(x, lbig_from_long(b));
+  }
+
+  /* Any other negative power truncates to zero */
+  if (y->neg) { return bigop_set(x, lbig_from_long(0)); }
+
+  if (!lbig_to_long(y, &e) || e > LBIG_MAX_BITS / lbig_bits(*x)) {
+    return "Number too large!";
+  }
+  return bigop_set(x, lbig_pow(*x, (unsigned long)e));
+}
+
+static lbigop bigops[LSYM_BUILTINS] = {
+  bigop_add, bigop_sub, bigop_mul, bigop_div,
+  bigop_mod, bigop_pow, bigop_min, bigop_max
+};
+
+/* Folds y, which is only read, into the builtin id's running result x */
+const char *lnum_fold(int id, lnum *x, lnum y) {
+  if (!x->big && !y.big) {
+    const char *err = builtins[id](&x->num, y.num);
+    if (err != lnum_overflow) { return err; }
+  }
+  if (!x->big) { x->big = lbig_from_long(x->num); }
+  lbig *t = y.big ? NULL : lbig_from_long(y.num);
+  const char *err = bigops[id](&x->big, y.big ? y.big : t);
+  free(t);
+  return err;
+}
+
+void lnum_neg(lnum *x) {
+  if (!x->big && x->num != LONG_MIN) { x->num = -x->num; return; }
+  if (!x->big) { x->big = lbig_from_long(x->num); }
+  x->big->neg = x->big->n > 0 && !x->big->neg;
+}
+
+/* Drops back to a long when the value fits */
+void lnum_trim(lnum *x) {
+  if (x->big && lbig_to_long(x->big, &x->num)) {
+    free(x->big);
+    x->big = NULL;
+  }
+}
+
+/* The big integer, if any, is shared with v */
+lnum lval_to_lnum(lval *v) {
+  lnum x = { 0, NULL };
+  if (lval_type(v) == LVAL_BIG) { x.big = v->big; } else { x.num = lval_to_num(v); }
+  return x;
+}
+
+/* Takes ownership of any big integer in x */
+lval *lval_from_lnum(lnum x) {
+  lnum_trim(&x);
+  return x.big ? lval_big(x.big) : lval_num(x.num);
+}
+
+/*
+ * Reductions
+ *
+ * Now that no step can wrap, +, *, min and max give the same result
+ * whatever order their arguments are combined in. Long calls of
+ * plain longs are gathered a block at a time into an array and
+ * reduced in LNUM_LANES independent lanes, which GCC and Clang put in
+ * vector registers. Sums keep a mask of lanes that overflowed; if any
+ * did, or a product overflows, the caller folds the arguments again
+ * one at a time.
+ */
+
+enum { LNUM_LANES = 4, LNUM_REDUCE_MIN = 16, LNUM_REDUCE_BUF = 256 };
+
+#if defined(__GNUC__)
+typedef long lnum_vec __attribute__((vector_size(LNUM_LANES * sizeof(long))));
+typedef unsigned long lnum_uvec __attribute__((vector_size(LNUM_LANES * sizeof(long))));
+/* Before SSE4.2 x86 has no 64 bit lane compare, and a scalar min or max is faster */
+#if defined(__SSE4_2__) || defined(__aarch64__)
+#define LNUM_VEC_CMP
+#endif
+#endif
+
+int lnum_reducible(int id) {
+  return id == LSYM_ADD || id == LSYM_MUL || id == LSYM_MIN || id == LSYM_MAX;
+}
+
+/* Returns 0 if a sum overflowed somewhere, otherwise writes it to r */
+int lnum_reduce_add(const long *xs, int n, long *r) {
+  long acc = 0;
+  int i = 0;
+#if defined(__GNUC__)
+  lnum_uvec sum = { 0 }, over = { 0 };
+  for (; i + LNUM_LANES <= n; i += LNUM_LANES) {
+    lnum_uvec x, t;
+    memcpy(&x, xs + i, sizeof(x));
+    t = sum + x;
+    /* The sign bit is set where both operands differ in sign from the result */
+    over |= (sum ^ t) & (x ^ t);
+    sum = t;
+  }
+  for (int k = 0; k < LNUM_LANES; ++k) {
+    if ((long)over[k] < 0 || lnum_add_overflow(acc, (long)sum[k], &acc)) { return 0; }
+  }
+#endif
+  for (; i < n; ++i) {
+    if (lnum_add_overflow(acc, xs[i], &acc)) { return 0; }
+  }
+  *r = acc;
+  return 1;
+}
+
+/* There is no vector multiply with an overflow check, so the lanes are independent scalar chains */
+int lnum_reduce_mul(const long *xs, int n, long *r) {
+  long lane[LNUM_LANES];
+  int i = 0;
+  for (int k = 0; k < LNUM_LANES; ++k) { lane[k] = 1; }
+  for (; i + LNUM_LANES <= n; i += LNUM_LANES) {
+    int over = 0;
+    for (int k = 0; k < LNUM_LANES; ++k) {
+      over |= lnum_mul_overflow(lane[k], xs[i + k], &lane[k]);
+    }
+    if (over) { return 0; }
+  }
+  for (; i < n; ++i) {
+    if (lnum_mul_overflow(lane[0], xs[i], &lane[0])) { return 0; }
+  }
+  for (int k = 1; k < LNUM_LANES; ++k) {
+    if (lnum_mul_overflow(lane[0], lane[k], &lane[0])) { return 0; }
+  }
+  *r = lane[0];
+  return 1;
+}
+
+/* The smallest of the longs, or the largest when max is set */
+long lnum_reduce_minmax(const long *xs, int n, int max) {
+  long acc = xs[0];
+  int i = 1;
+#if defined(LNUM_VEC_CMP)
+  if (n >= LNUM_LANES) {
+    lnum_vec best;
+    memcpy(&best, xs, sizeof(best));
+    for (i = LNUM_LANES; i + LNUM_LANES <= n; i += LNUM_LANES) {
+      lnum_vec x, take;
+      memcpy(&x, xs + i, sizeof(x));
+      if (max) { take = x > best; } else { take = x < best; }
+      best = (x & take) | (best & ~take);
+    }
+    for (int k = 0; k < LNUM_LANES; ++k) {
+      if (max ? best[k] > acc : best[k] < acc) { acc = best[k]; }
+    }
+  }
+#endif
+  for (; i < n; ++i) {
+    if (max ? xs[i] > acc : xs[i] < acc) { acc = xs[i]; }
+  }
+  return acc;
+}
+
+/* Reduces n > 0 longs with builtin id, or returns 0 to fall back to folding */
+int lnum_reduce(int id, const long *xs, int n, long *r) {
+  switch (id) {
+  case LSYM_ADD: return lnum_reduce_add(xs, n, r);
+  case LSYM_MUL: return lnum_reduce_mul(xs, n, r);
+  case LSYM_MIN: *r = lnum_reduce_minmax(xs, n, 0); return 1;
+  case LSYM_MAX: *r = lnum_reduce_minmax(xs, n, 1); return 1;
+  }
+  return 0;
+}
+
+/* Reduces a->cell[1] on a block at a time, unless one is not a long */
+int builtin_reduce(lval *a, int id, long *r) {
+  long xs[LNUM_REDUCE_BUF], part;
+  for (int i = 1; i < a->count;) {
+    int n = 0;
+    for (; n < LNUM_REDUCE_BUF && i < a->count; ++n, ++i) {
+      if (lval_type(a->cell[i]) != LVAL_NUM) { return 0; }
+      xs[n] = lval_to_num(a->cell[i]);
+    }
+    if (!lnum_reduce(id, xs, n, &part)) { return 0; }
+    /* The first block starts at cell 1, later ones are folded into it */
+    if (i - n == 1) { *r = part; } else if (builtins[id](r, part)) { return 0; }
+  }
+  return 1;
+}
+
+/*
+ * The arguments are read in place from a->cell[1] on, after the
+ * operator, and the whole expression is deleted once at the end.
+ */
+
+lval* builtin_op(lval* a, int id) {
+    /* Long calls that only hold longs are checked and reduced in lanes*/
+    long r;
+    if (a->count > LNUM_REDUCE_MIN && lnum_reducible(id) && builtin_reduce(a, id, &r)) {
+        lval_del(a);
+        return lval_num(r);
+    }
+
     /* Ensure all arguments are numbers*/
-    for(int i = 0; i < a->count; ++i) {
-        if (a->cell[i]->type != LVAL_NUM) {
+    for(int i = 1; i < a->count; ++i) {
+        if (!lval_is_num(a->cell[i])) {
             lval_del(a);
             return lval_err("Cannot operate on non-number!");
         }
     }
 
-    /* pop the first element*/
-    lval *x = lval_pop(a, 0);
+    /* start from the first argument, with a copy of it if it is big*/
+    lnum acc = lval_to_lnum(a->cell[1]);
+    if (acc.big) { acc.big = lbig_copy(acc.big); }
 
-    /* If no arguments and sub then perform unary negation*/
-    if((strcmp(op, "-") == 0) && a->count == 0) {
-        x->num = -x->num;
+    /* If no other arguments and sub then perform unary negation*/
+    if(id == LSYM_SUB && a->count == 2) {
+        lnum_neg(&acc);
     }
 
-    /*While there are still elements remaining*/
-    while(a->count > 0) {
-        /* Pop the next element*/
-        lval *y = lval_pop(a, 0);
-
-        if (strcmp(op, "+") == 0) { x->num += y->num;}
-        if (strcmp(op, "-") == 0) { x->num -= y->num;}
-        if (strcmp(op, "*") == 0) { x->num *= y->num;}
-        if (strcmp(op, "/") == 0) {
-            if (y->num == 0) {
-                lval_del(x);
-                lval_del(y);
-                x = lval_err("Division by zero!");
-                break;
-            }
-            x->num /= y->num;
+    /* Unknown operators leave the first argument as it is */
+    for (int i = 2; id < LSYM_BUILTINS && i < a->count; ++i) {
+        const char *err = lnum_fold(id, &acc, lval_to_lnum(a->cell[i]));
+        if (err) {
+            free(acc.big);
+            lval_del(a);
+            return lval_err((char*)err);
         }
-        lval_del(y);
     }
     lval_del(a);
-    return x;
+    return lval_from_lnum(acc);
 }
 
 /*Use operator string to see which operation to perform*/
 
 lval *eval_op(lval *x, char *op, lval *y) {
 
-  if (x->type == LVAL_ERR) {
+  if (lval_type(x) == LVAL_ERR) {
     return lval_err("Error y");
   }
 
-  if (y->type == LVAL_ERR) {
+  if (lval_type(y) == LVAL_ERR) {
     return lval_err("Error y");
   }
 
-  if (strcmp(op, "+") == 0) {
-    return lval_num(x->num + y->num);
+  int id = lsym_intern(op);
+  if (id >= LSYM_BUILTINS) {
+    return lval_err("BAD OPERATOR");
   }
 
-  if (strcmp(op, "-") == 0) {
-    return lval_num(x->num - y->num);
-  }
-
-  if (strcmp(op, "*") == 0) {
-    return lval_num(x->num * y->num);
-  }
+  lnum a = lval_to_lnum(x);
+  if (a.big) { a.big = lbig_copy(a.big); }
 
-  if (strcmp(op, "/") == 0) {
-    return y->num == 0 ? lval_err("Divison by zero")
-                       : lval_num(x->num / y->num);
-  }
-  if (strcmp(op, "%") == 0) {
-    return lval_num(x->num % y->num);
-  }
-  if (strcmp(op, "min") == 0) {
-    return lval_num(x->num < y->num ? x->num : y->num);
-  }
-  if (strcmp(op, "max.num") == 0) {
-    return lval_num(x->num > y->num ? x->num : y->num);
-  }
-  if (strcmp(op, "^") == 0) {
-    return lval_num(pow(x->num, y->num));
+  const char *err = lnum_fold(id, &a, lval_to_lnum(y));
+  if (err) {
+    free(a.big);
+    return lval_err((char*)err);
   }
-  return lval_err("BAD OPERATOR");
+  return lval_from_lnum(a);
 }
 
 lval *lval_read_num(mpc_ast_t *t) {
   errno = 0;
   long x = strtol(t->contents, NULL, 10);
-  return errno != ERANGE ? lval_num(x) : lval_err("Invalid Number");
+  if (errno != ERANGE) { return lval_num(x); }
+  /* Out of the range of a long, so it is read as a big integer */
+  return lval_big(lbig_from_str(t->contents, t->contents + strlen(t->contents)));
 }
 
 lval *lval_add(lval *v, lval *x) {
-  v->count++;
-  v->cell = realloc(v->cell, sizeof(lval *) * v->count);
-  v->cell[v->count - 1] = x;
+  if (v->count == v->slots) {
+    v->slots = v->slots ? v->slots * 2 : 4;
+    v->cell = realloc(v->cell, sizeof(lval *) * v->slots);
+  }
+  v->cell[v->count++] = x;
+  v->size += lval_size(x);
   return v;
 }
 
+/* Tag ids of the grammar rules, looked up once after mpca_lang */
+static int tag_number, tag_symbol, tag_sexpr;
+
 lval* lval_read(mpc_ast_t* t) {
   
   /* If Symbol or Number return conversion to that type */
-  if (strstr(t->tag, "number")) { return lval_read_num(t); }
-  if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
+  if (mpc_ast_has_tag(t, tag_number)) { return lval_read_num(t); }
+  if (mpc_ast_has_tag(t, tag_symbol)) { return lval_sym(t->contents); }
   
-  /* If root (>) or sexpr then create empty list */
+  /* If root (>) or sexpr then create empty list, sized for every child */
   lval* x = NULL;
-  if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); } 
-  if (strstr(t->tag, "sexpr"))  { x = lval_sexpr(); }
+  if (strcmp(t->tag, ">") == 0) { x = lval_sexpr_sized(t->children_num); } 
+  if (mpc_ast_has_tag(t, tag_sexpr)) { x = lval_sexpr_sized(t->children_num); }
   
   /* Fill this list with any valid expression contained within */
   for (int i = 0; i < t->children_num; i++) {
@@ -321,6 +1258,479 @@ lval* lval_read(mpc_ast_t* t) {
   return x;
 }
 
+/*
+ * Native Reader
+ *
+ * Reads a line of the lispy grammar straight into lvals in one pass
+ * over the text, using a table of byte classes, with no mpc_ast_t in
+ * between. It gives the same lvals as lval_read on the parse tree.
+ * Anything it does not accept makes it return NULL, so the grammar
+ * can be run instead to report the error.
+ */
+
+enum { LREAD_SPACE = 1, LREAD_DIGIT = 2, LREAD_SYM = 4 };
+
+static const unsigned char lread_class[256] = {
+  [' '] = LREAD_SPACE, ['\f'] = LREAD_SPACE, ['\n'] = LREAD_SPACE,
+  ['\r'] = LREAD_SPACE, ['\t'] = LREAD_SPACE, ['\v'] = LREAD_SPACE,
+  ['0'] = LREAD_DIGIT, ['1'] = LREAD_DIGIT, ['2'] = LREAD_DIGIT,
+  ['3'] = LREAD_DIGIT, ['4'] = LREAD_DIGIT, ['5'] = LREAD_DIGIT,
+  ['6'] = LREAD_DIGIT, ['7'] = LREAD_DIGIT, ['8'] = LREAD_DIGIT,
+  ['9'] = LREAD_DIGIT,
+  ['+'] = LREAD_SYM, ['-'] = LREAD_SYM, ['*'] = LREAD_SYM,
+  ['/'] = LREAD_SYM, ['%'] = LREAD_SYM, ['^'] = LREAD_SYM
+};
+
+#define LREAD_IS(c, k) (lread_class[(unsigned char)(c)] & (k))
+
+lval *lval_read_str(const char *s) {
+  /* Open S-expressions wait on a stack rather than the C stack */
+  lval **open = NULL;
+  int depth = 0, slots = 0;
+  lval *cur = lval_sexpr();
+  char sym[2] = { '\0', '\0' };
+
+  while (1) {
+    char c = *s;
+
+    if (LREAD_IS(c, LREAD_SPACE)) { s++; continue; }
+    if (c == '\0') { break; }
+
+    if (c == '(') {
+      if (depth == slots) {
+        slots = slots ? slots * 2 : 16;
+        open = realloc(open, sizeof(lval *) * slots);
+      }
+      open[depth++] = cur;
+      cur = lval_sexpr();
+      s++;
+      continue;
+    }
+
+    if (c == ')') {
+      if (depth == 0) { break; }
+      lval *parent = open[--depth];
+      lval_add(parent, cur);
+      cur = parent;
+      s++;
+      continue;
+    }
+
+    /* As in the grammar a '-' is part of a number when a digit follows */
+    if (LREAD_IS(c, LREAD_DIGIT) || (c == '-' && LREAD_IS(s[1], LREAD_DIGIT))) {
+      char *end;
+      errno = 0;
+      long x = strtol(s, &end, 10);
+      lval_add(cur, errno != ERANGE ? lval_num(x) : lval_big(lbig_from_str(s, end)));
+      s = end;
+      continue;
+    }
+
+    if (LREAD_IS(c, LREAD_SYM)) {
+      sym[0] = c;
+      lval_add(cur, lval_sym(sym));
+      s++;
+      continue;
+    }
+
+    if (strncmp(s, "min", 3) == 0 || strncmp(s, "max", 3) == 0) {
+      char name[4] = { s[0], s[1], s[2], '\0' };
+      lval_add(cur, lval_sym(name));
+      s += 3;
+      continue;
+    }
+
+    break;
+  }
+
+  /* Stopped early or with brackets left open */
+  if (*s != '\0' || depth != 0) {
+    lval_del(cur);
+    while (depth > 0) { lval_del(open[--depth]); }
+    free(open);
+    return NULL;
+  }
+
+  free(open);
+  return cur;
+}
+
+#undef LREAD_IS
+
+/*
+ * Constant Folding
+ *
+ * Run once between reading and compiling. An S-expression whose
+ * children have all folded to plain values is evaluated there and
+ * replaced by its result, errors included, so the compiled code just
+ * pushes that value. The language has no variables yet, so today
+ * every line folds to a single value. Setting LISPY_NOFOLD skips the
+ * pass so the whole expression is compiled and run on the VM.
+ */
+
+int lval_is_const(lval *v) {
+  return lval_type(v) != LVAL_SEXPR || v->count == 0;
+}
+
+lval *lval_fold(lval *v) {
+  if (lval_is_const(v)) { return v; }
+  lval_eval_cells(v, lval_fold);
+  for (int i = 0; i < v->count; ++i) {
+    if (!lval_is_const(v->cell[i])) { return v; }
+  }
+  return lval_eval_sexpr(v);
+}
+
+/*
+ * Bytecode
+ *
+ * An expression is compiled once into a flat stack code which a
+ * small VM runs, so evaluating it again walks no tree and allocates
+ * nothing. Each instruction is an opcode word and one operand. When
+ * the head of an S-expression is a known operator it is compiled to
+ * an arithmetic opcode; any other head is checked when called.
+ */
+
+/* A builtin call is LOP_BUILTIN plus the builtin's symbol id */
+enum { LOP_NUM, LOP_SYM, LOP_ERR, LOP_NIL, LOP_CALL, LOP_HALT, LOP_BIG, LOP_BUILTIN };
+
+/*
+ * VM values: errors point at strings owned by the code or static,
+ * symbols keep their id in num, and a big integer is owned by the
+ * stack slot holding it until an instruction consumes it.
+ */
+typedef struct {
+  int type;
+  long num;
+  const char *str;
+  lbig *big;
+} lvm_val;
+
+typedef struct lcode {
+  long *code;
+  int count;
+  int slots;
+  char **strs;
+  int strs_count;
+  lbig **bigs;
+  int bigs_count;
+  int depth;
+  int max_depth;
+  lvm_val *stack;
+} lcode;
+
+void lcode_emit(lcode *c, int op, long arg, int effect) {
+  if (c->count + 2 > c->slots) {
+    c->slots = c->slots ? c->slots * 2 : 16;
+    c->code = realloc(c->code, sizeof(long) * c->slots);
+  }
+  c->code[c->count++] = op;
+  c->code[c->count++] = arg;
+  c->depth += effect;
+  if (c->depth > c->max_depth) { c->max_depth = c->depth; }
+}
+
+long lcode_str(lcode *c, const char *s) {
+  c->strs = realloc(c->strs, sizeof(char *) * (c->strs_count + 1));
+  c->strs[c->strs_count] = malloc(strlen(s) + 1);
+  strcpy(c->strs[c->strs_count], s);
+  return c->strs_count++;
+}
+
+long lcode_big(lcode *c, const lbig *a) {
+  c->bigs = realloc(c->bigs, sizeof(lbig *) * (c->bigs_count + 1));
+  c->bigs[c->bigs_count] = lbig_copy(a);
+  return c->bigs_count++;
+}
+
+void lcode_compile(lcode *c, lval *v) {
+  switch (lval_type(v)) {
+  case LVAL_NUM:
+    lcode_emit(c, LOP_NUM, lval_to_num(v), 1);
+    break;
+  case LVAL_BIG:
+    lcode_emit(c, LOP_BIG, lcode_big(c, v->big), 1);
+    break;
+  case LVAL_ERR:
+    lcode_emit(c, LOP_ERR, lcode_str(c, v->err), 1);
+    break;
+  case LVAL_SYM:
+    lcode_emit(c, LOP_SYM, v->id, 1);
+    break;
+  case LVAL_SEXPR:
+    if (v->count == 0) { lcode_emit(c, LOP_NIL, 0, 1); break; }
+    if (v->count == 1) { lcode_compile(c, v->cell[0]); break; }
+    int id = lval_type(v->cell[0]) == LVAL_SYM ? v->cell[0]->id : LSYM_BUILTINS;
+    for (int i = id < LSYM_BUILTINS ? 1 : 0; i < v->count; ++i) {
+      lcode_compile(c, v->cell[i]);
+    }
+    if (id < LSYM_BUILTINS) { lcode_emit(c, LOP_BUILTIN + id, v->count - 1, 2 - v->count); }
+    else                    { lcode_emit(c, LOP_CALL, v->count, 1 - v->count); }
+    break;
+  }
+}
+
+lcode *lval_compile(lval *v) {
+  lcode *c = calloc(1, sizeof(lcode));
+  lcode_compile(c, v);
+  lcode_emit(c, LOP_HALT, 0, 0);
+  c->stack = malloc(sizeof(lvm_val) * c->max_depth);
+  return c;
+}
+
+void lcode_del(lcode *c) {
+  for (int i = 0; i < c->strs_count; ++i) {
+    free(c->strs[i]);
+  }
+  free(c->strs);
+  for (int i = 0; i < c->bigs_count; ++i) {
+    free(c->bigs[i]);
+  }
+  free(c->bigs);
+  free(c->code);
+  free(c->stack);
+  free(c);
+}
+
+/* Frees the big integers among values an instruction has consumed */
+void lvm_drop(lvm_val *xs, int n) {
+  for (int i = 0; i < n; ++i) {
+    if (xs[i].type == LVAL_BIG) { free(xs[i].big); }
+  }
+}
+
+/* Leaves any error for the call in xs[0], as lval_eval_sexpr and builtin_op would */
+int lvm_check(lvm_val *xs, int n) {
+  for (int i = 0; i < n; ++i) {
+    if (xs[i].type == LVAL_ERR) {
+      lvm_val e = xs[i];
+      lvm_drop(xs, n);
+      xs[0] = e;
+      return 1;
+    }
+  }
+  for (int i = 0; i < n; ++i) {
+    if (xs[i].type != LVAL_NUM && xs[i].type != LVAL_BIG) {
+      lvm_drop(xs, n);
+      xs[0].type = LVAL_ERR;
+      xs[0].str = "Cannot operate on non-number!";
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void lvm_arith(int id, lvm_val *xs, int n) {
+  const char *err = NULL;
+  int i = 1;
+
+  /* Longs are folded in place until a step overflows or meets a big integer */
+  if (xs[0].type == LVAL_NUM && id < LSYM_BUILTINS && !(id == LSYM_SUB && n == 1)) {
+    lbuiltin f = builtins[id];
+    for (; i < n && xs[i].type == LVAL_NUM; ++i) {
+      if ((err = f(&xs[0].num, xs[i].num))) { break; }
+    }
+    if (i == n) { return; }
+    if (err && err != lnum_overflow) {
+      lvm_drop(xs + i, n - i);
+      xs[0].type = LVAL_ERR;
+      xs[0].str = err;
+      return;
+    }
+    err = NULL;
+  }
+
+  /* The rest goes through lnum_fold, which redoes an overflowed step on big integers */
+  lnum acc = { xs[0].num, xs[0].type == LVAL_BIG ? xs[0].big : NULL };
+  if (id == LSYM_SUB && n == 1) { lnum_neg(&acc); }
+  for (; i < n; ++i) {
+    if (!err && id < LSYM_BUILTINS) {
+      lnum y = { xs[i].num, xs[i].type == LVAL_BIG ? xs[i].big : NULL };
+      err = lnum_fold(id, &acc, y);
+    }
+    if (xs[i].type == LVAL_BIG) { free(xs[i].big); }
+  }
+  if (err) {
+    free(acc.big);
+    xs[0].type = LVAL_ERR;
+    xs[0].str = err;
+    return;
+  }
+  lnum_trim(&acc);
+  xs[0].type = acc.big ? LVAL_BIG : LVAL_NUM;
+  xs[0].num = acc.num;
+  xs[0].big = acc.big;
+}
+
+/*
+ * With GCC or Clang each opcode jumps straight to the next one's
+ * handler through a table of label addresses; elsewhere the jump
+ * goes back through a switch.
+ */
+
+#if defined(__GNUC__)
+#define LVM_NEXT goto *labels[*pc]
+#else
+#define LVM_NEXT goto dispatch
+#endif
+
+lvm_val lcode_run(lcode *c) {
+  long *pc = c->code;
+  lvm_val *sp = c->stack;
+  int n;
+
+#if defined(__GNUC__)
+  static void *labels[LOP_BUILTIN + LSYM_BUILTINS] = {
+    &&op_num, &&op_sym, &&op_err, &&op_nil, &&op_call, &&op_halt,
+    &&op_big, &&op_builtin, &&op_builtin, &&op_builtin, &&op_builtin,
+    &&op_builtin, &&op_builtin, &&op_builtin, &&op_builtin
+  };
+#endif
+
+  LVM_NEXT;
+
+#if !defined(__GNUC__)
+dispatch:
+  switch (*pc) {
+  case LOP_NUM: goto op_num;
+  case LOP_SYM: goto op_sym;
+  case LOP_ERR: goto op_err;
+  case LOP_NIL: goto op_nil;
+  case LOP_CALL: goto op_call;
+  case LOP_HALT: goto op_halt;
+  case LOP_BIG: goto op_big;
+  default: goto op_builtin;
+  }
+#endif
+
+op_num:
+  sp->type = LVAL_NUM;
+  sp->num = pc[1];
+  sp++; pc += 2;
+  LVM_NEXT;
+
+op_big:
+  sp->type = LVAL_BIG;
+  sp->big = lbig_copy(c->bigs[pc[1]]);
+  sp++; pc += 2;
+  LVM_NEXT;
+
+op_sym:
+  sp->type = LVAL_SYM;
+  sp->num = pc[1];
+  sp++; pc += 2;
+  LVM_NEXT;
+
+op_err:
+  sp->type = LVAL_ERR;
+  sp->str = c->strs[pc[1]];
+  sp++; pc += 2;
+  LVM_NEXT;
+
+op_nil:
+  sp->type = LVAL_SEXPR;
+  sp++; pc += 2;
+  LVM_NEXT;
+
+op_builtin:
+  n = (int)pc[1];
+  sp -= n;
+  if (!lvm_check(sp, n)) { lvm_arith((int)*pc - LOP_BUILTIN, sp, n); }
+  sp++; pc += 2;
+  LVM_NEXT;
+
+  /* The head is only known now: errors come first, then the head must be a symbol */
+op_call:
+  n = (int)pc[1];
+  sp -= n;
+  for (int i = 0; i < n; ++i) {
+    if (sp[i].type == LVAL_ERR) {
+      lvm_val e = sp[i];
+      lvm_drop(sp, n);
+      sp[0] = e;
+      goto call_done;
+    }
+  }
+  if (sp[0].type != LVAL_SYM) {
+    lvm_drop(sp, n);
+    sp[0].type = LVAL_ERR;
+    sp[0].str = "S-expression does not start with symbol!";
+    goto call_done;
+  }
+  if (!lvm_check(sp + 1, n - 1)) { lvm_arith((int)sp[0].num, sp + 1, n - 1); }
+  sp[0] = sp[1];
+call_done:
+  sp++; pc += 2;
+  LVM_NEXT;
+
+op_halt:
+  return sp[-1];
+}
+
+#undef LVM_NEXT
+
+void lvm_println(lvm_val v) {
+  switch (v.type) {
+  case LVAL_NUM:   printf("%li\n", v.num); break;
+  case LVAL_BIG:   lbig_print(v.big); putchar('\n'); break;
+  case LVAL_ERR:   printf("Error %s\n", v.str); break;
+  case LVAL_SYM:   printf("%s\n", lsym_names[v.num]); break;
+  case LVAL_SEXPR: printf("()\n"); break;
+  }
+}
+
+/* Frees what lcode_run handed back, once it has been used */
+void lvm_release(lvm_val v) {
+  if (v.type == LVAL_BIG) { free(v.big); }
+}
+
+/*
+ * Compiled code for the last lines read, keyed by their text, so a
+ * repeated line is neither parsed nor compiled again.
+ */
+
+enum { LCACHE_SLOTS = 64 };
+
+typedef struct {
+  char *input;
+  lcode *code;
+} lcache_entry;
+
+static lcache_entry lcache[LCACHE_SLOTS];
+
+unsigned long lcache_hash(const char *s) {
+  unsigned long h = 5381;
+  while (*s) { h = h * 33 + (unsigned char)*s++; }
+  return h % LCACHE_SLOTS;
+}
+
+lcode *lcache_find(const char *input) {
+  lcache_entry *e = &lcache[lcache_hash(input)];
+  return e->input && strcmp(e->input, input) == 0 ? e->code : NULL;
+}
+
+lcode *lcache_store(const char *input, lcode *c) {
+  lcache_entry *e = &lcache[lcache_hash(input)];
+  if (e->input) {
+    free(e->input);
+    lcode_del(e->code);
+  }
+  e->input = malloc(strlen(input) + 1);
+  strcpy(e->input, input);
+  e->code = c;
+  return c;
+}
+
+void lcache_clear(void) {
+  for (int i = 0; i < LCACHE_SLOTS; ++i) {
+    if (lcache[i].input) {
+      free(lcache[i].input);
+      lcode_del(lcache[i].code);
+      lcache[i].input = NULL;
+    }
+  }
+}
+
 int number_of_expr_nodes(mpc_ast_t *t) {
   int total = strstr(t->tag, "expr") ? 1 : 0;
   for (int i = 0; i < t->children_num; ++i) {
@@ -347,15 +1757,31 @@ int main() {
   mpc_parser_t* Expr   = mpc_new("expr");
   mpc_parser_t* Lispy  = mpc_new("lispy");
   
-  mpca_lang(MPCA_LANG_DEFAULT,
+  mpca_lang(MPCA_LANG_ARENA,
     "                                          \
       number : /-?[0-9]+/ ;                    \
-      symbol : '+' | '-' | '*' | '/' ;         \
+      symbol : '+' | '-' | '*' | '/' | '%'     \
+             | '^' | \"min\" | \"max\" ;       \
       sexpr  : '(' <expr>* ')' ;               \
       expr   : <number> | <symbol> | <sexpr> ; \
       lispy  : /^/ <expr>* /$/ ;               \
     ",
     Number, Symbol, Sexpr, Expr, Lispy);
+
+  tag_number = mpc_tag_id("number");
+  tag_symbol = mpc_tag_id("symbol");
+  tag_sexpr  = mpc_tag_id("sexpr");
+
+  /* One session is reused for every line read */
+  mpc_session_t* session = mpc_session_new();
+
+  /* LISPY_THREADS=n evaluates large sub-expressions on n threads */
+  char* threads = getenv("LISPY_THREADS");
+  lpool_start(threads ? atoi(threads) : 1);
+
+  /* LISPY_NOFOLD leaves every line to the VM rather than folding it */
+  int fold = getenv("LISPY_NOFOLD") == NULL;
+
   puts("Lispy Version 0.0.0.0.2");
   puts("Press Ctrl+c to Exit\n");
 
@@ -364,15 +1790,33 @@ while (1) {
     char* input = readline("lispy> ");
     add_history(input);
     
+    /* Lines seen before are run from their compiled code */
+    lcode* code = lcache_find(input);
+
+    /* Lines the native reader rejects go through the grammar for its error */
+    lval* x = code ? NULL : lval_read_str(input);
+
     mpc_result_t r;
-    if (mpc_parse("<stdin>", input, Lispy, &r)) {
-      lval* x = lval_eval(lval_read(r.output));
-      lval_println(x);
+    if (code == NULL && x == NULL) {
+      if (mpc_session_parse(session, "<stdin>", input, Lispy, &r)) {
+        x = lval_read(r.output);
+        mpc_ast_delete(r.output);
+      } else {
+        mpc_err_print(r.error);
+        mpc_err_delete(r.error);
+      }
+    }
+
+    if (x) {
+      if (fold) { x = lval_fold(x); }
+      code = lcache_store(input, lval_compile(x));
       lval_del(x);
-      mpc_ast_delete(r.output);
-    } else {    
-      mpc_err_print(r.error);
-      mpc_err_delete(r.error);
+    }
+
+    if (code) {
+      lvm_val v = lcode_run(code);
+      lvm_println(v);
+      lvm_release(v);
     }
     
     free(input);
@@ -380,6 +1824,10 @@ while (1) {
   }
 
   /* Undefine and delete our parsers */
+  lpool_stop();
+  lcache_clear();
+  lsym_clear();
+  mpc_session_delete(session);
   mpc_cleanup(5, Number, Symbol, Sexpr, Expr, Lispy);
 
   return 0;
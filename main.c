@@ -114,9 +114,12 @@ long eval_op(long x, char *op, long y) {
   return 0;
 }
 
+/* Tag ids of the grammar rules, looked up once after mpca_lang */
+static int tag_number, tag_expr;
+
 long eval(mpc_ast_t *t) {
   /*if tagged as number return it directly*/
-  if (strstr(t->tag, "number")) {
+  if (mpc_ast_has_tag(t, tag_number)) {
     return atoi(t->contents);
   }
 
@@ -125,12 +128,12 @@ long eval(mpc_ast_t *t) {
 
   /*We store the third child in 'x'*/
   long x = eval(t->children[2]);
-  if (!strstr(t->children[3]->tag, "expr") && (strcmp(op, "-") == 0)) {
+  if (!mpc_ast_has_tag(t->children[3], tag_expr) && (strcmp(op, "-") == 0)) {
 
     x = eval_op(0, op, x);
   } else {
     int i = 3;
-    while (strstr(t->children[i]->tag, "expr")) {
+    while (mpc_ast_has_tag(t->children[i], tag_expr)) {
       x = eval_op(x, op, eval(t->children[i]));
       i++;
     }
@@ -165,7 +168,7 @@ int main() {
   mpc_parser_t *Lispy = mpc_new("lispy");
 
   /* Define them with the following Language */
-  mpca_lang(MPCA_LANG_DEFAULT,
+  mpca_lang(MPCA_LANG_ARENA,
             "                                                     \
       number   : /-?[0-9]+/ ;                             \
       operator : '+' | '-' | '*' | '/' | '%' | '^' | \"min\" | \"max\" ;                  \
@@ -174,6 +177,12 @@ int main() {
     ",
             Number, Operator, Expr, Lispy);
 
+  tag_number = mpc_tag_id("number");
+  tag_expr = mpc_tag_id("expr");
+
+  /* One session is reused for every line read */
+  mpc_session_t *session = mpc_session_new();
+
   puts("Lispy Version 0.0.0.0.2");
   puts("Press Ctrl+c to Exit\n");
 
@@ -183,7 +192,7 @@ int main() {
 
     /* Attempt to parse the user input */
     mpc_result_t r;
-    if (mpc_parse("<stdin>", input, Lispy, &r)) {
+    if (mpc_session_parse(session, "<stdin>", input, Lispy, &r)) {
       /* On success print and delete the AST */
       /* Load AST From output*/
       mpc_ast_t *a = r.output;
@@ -233,6 +242,7 @@ int main() {
   }
 
   /* Undefine and delete our parsers */
+  mpc_session_delete(session);
   mpc_cleanup(4, Number, Operator, Expr, Lispy);
 
   return 0;
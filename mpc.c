@@ -1,5 +1,35 @@
+#if !defined(MPC_NO_MMAP) && (defined(__unix__) || defined(__APPLE__))
+#define MPC_MMAP
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+#endif
+
 #include "mpc.h"
 
+#ifdef MPC_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if !defined(MPC_NO_THREADS) && (defined(__unix__) || defined(__APPLE__))
+#define MPC_PTHREADS
+#include <pthread.h>
+#elif !defined(MPC_NO_THREADS) && defined(_WIN32)
+#define MPC_WINTHREADS
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#endif
+
+#if !defined(MPC_NO_SIMD) && defined(__GNUC__) && defined(__AVX2__)
+#define MPC_SIMD_AVX2
+#include <immintrin.h>
+#elif !defined(MPC_NO_SIMD) && defined(__GNUC__) && defined(__SSSE3__)
+#define MPC_SIMD_SSSE3
+#include <tmmintrin.h>
+#endif
+
 /*
 ** State Type
 */
@@ -27,13 +57,16 @@ static mpc_state_t mpc_state_new(void) {
 */
 
 /*
-** In mpc the input type has three modes of
-** operation: String, File and Pipe.
+** In mpc the input type has four modes of
+** operation: String, File, Pipe and Mmap.
 **
-** String is easy. The whole contents are
-** loaded into a buffer and scanned through.
+** String is easy. The caller's buffer is
+** scanned through directly and never copied.
 ** The cursor can jump around at will making
-** backtracking easy.
+** backtracking easy. The end of input is either
+** the null terminator or, for a View, the length
+** given by the caller - in which case the buffer
+** may contain null characters of its own.
 **
 ** The second is a File which is also somewhat
 ** easy. The contents are never loaded into
@@ -41,15 +74,23 @@ static mpc_state_t mpc_state_new(void) {
 ** by seeking in the file at different positions.
 **
 ** The final mode is Pipe. This is the difficult
-** one. As we assume pipes cannot be seeked - and
-** only support a single character lookahead at
-** any point, when the input is marked for a
-** potential backtracking we start buffering any
-** input.
+** one. As we assume pipes cannot be seeked all
+** input is read a block at a time into a ring
+** buffer, and characters are only discarded
+** from it once they are older than the earliest
+** live mark.
 **
 ** This means that if we are requested to seek
 ** back we can simply start reading from the
-** buffer instead of the input.
+** buffer again. Anything left unconsumed in the
+** buffer is pushed back onto the pipe when the
+** input is deleted.
+**
+** Mmap is used in place of File whenever the
+** file is a regular file that can be mapped
+** into memory. It behaves just like String but
+** the contents are never copied and the end of
+** input is given by the length of the file.
 **
 ** Of course using `mpc_predictive` will disable
 ** backtracking and make LL(1) grammars easy
@@ -60,7 +101,9 @@ static mpc_state_t mpc_state_new(void) {
 enum {
   MPC_INPUT_STRING = 0,
   MPC_INPUT_FILE   = 1,
-  MPC_INPUT_PIPE   = 2
+  MPC_INPUT_PIPE   = 2,
+  MPC_INPUT_MMAP   = 3,
+  MPC_INPUT_VIEW   = 4
 };
 
 enum {
@@ -68,12 +111,204 @@ enum {
 };
 
 enum {
-  MPC_INPUT_MEM_NUM = 512
+  MPC_INPUT_BUFFER_MIN   = 4096,
+  MPC_INPUT_BUFFER_BLOCK = 4096
+};
+
+enum {
+  MPC_INPUT_MEMO_NUM = 4096
+};
+
+/*
+** Pools
+**
+** Each input carries a pool for the many short
+** lived allocations made while parsing. Sizes are
+** rounded up to one of a few size classes and each
+** class keeps its own free list, so allocation and
+** release are constant time.
+**
+** Memory comes from a short list of regions, each
+** twice the size of the last, split into an area of
+** a power of two bytes for each class. A class takes space from the newest
+** region once its own area is used up, so deeply
+** nested input grows the pool rather than falling
+** through to `malloc`. Only sizes above the largest
+** class, or anything once every region is in use,
+** go to `malloc`.
+**
+** The sizes can be set when compiling. Regions are
+** only allocated when first needed.
+*/
+
+#ifndef MPC_POOL_CLASSES
+#define MPC_POOL_CLASSES 5
+#endif
+
+#ifndef MPC_POOL_AREA_BITS
+#define MPC_POOL_AREA_BITS 12
+#endif
+
+#ifndef MPC_POOL_REGIONS
+#define MPC_POOL_REGIONS 8
+#endif
+
+enum {
+  MPC_POOL_CLASS_MIN = 16
 };
 
 typedef struct {
-  char mem[64];
-} mpc_mem_t;
+  int regions_num;
+  char *regions[MPC_POOL_REGIONS];
+  void *free[MPC_POOL_CLASSES];
+  char *next[MPC_POOL_CLASSES];
+  char *end[MPC_POOL_CLASSES];
+  int area[MPC_POOL_CLASSES];
+  mpc_pool_stats_t stats;
+} mpc_pool_t;
+
+/*
+** The process-wide totals are added to by parses
+** on any thread so are only touched atomically.
+*/
+
+static mpc_pool_stats_t mpc_pool_totals = { 0, 0, 0 };
+
+#if !defined(MPC_NO_THREADS) && defined(__GNUC__)
+static void mpc_count_add(long *c, long n) { __atomic_fetch_add(c, n, __ATOMIC_RELAXED); }
+static long mpc_count_get(long *c) { return __atomic_load_n(c, __ATOMIC_RELAXED); }
+static void mpc_count_clear(long *c) { __atomic_store_n(c, 0, __ATOMIC_RELAXED); }
+#elif defined(MPC_WINTHREADS)
+static void mpc_count_add(long *c, long n) { InterlockedExchangeAdd((volatile LONG*)c, n); }
+static long mpc_count_get(long *c) { return InterlockedCompareExchange((volatile LONG*)c, 0, 0); }
+static void mpc_count_clear(long *c) { InterlockedExchange((volatile LONG*)c, 0); }
+#else
+static void mpc_count_add(long *c, long n) { *c += n; }
+static long mpc_count_get(long *c) { return *c; }
+static void mpc_count_clear(long *c) { *c = 0; }
+#endif
+
+static void mpc_pool_stats_add(mpc_pool_stats_t *t, mpc_pool_stats_t *s) {
+  t->hits += s->hits;
+  t->misses += s->misses;
+  t->fallbacks += s->fallbacks;
+}
+
+/* Adds the counts of a finished parse to the totals and empties the pool, keeping its regions */
+
+static void mpc_pool_reset(mpc_pool_t *m) {
+  int k;
+  mpc_count_add(&mpc_pool_totals.hits, m->stats.hits);
+  mpc_count_add(&mpc_pool_totals.misses, m->stats.misses);
+  mpc_count_add(&mpc_pool_totals.fallbacks, m->stats.fallbacks);
+  memset(&m->stats, 0, sizeof(mpc_pool_stats_t));
+  for (k = 0; k < MPC_POOL_CLASSES; k++) {
+    m->free[k] = NULL;
+    m->next[k] = NULL;
+    m->end[k] = NULL;
+    m->area[k] = 0;
+  }
+}
+
+/*
+** AST Arenas
+**
+** Every node, string and child array of an arena
+** AST is carved out of a chain of large blocks so
+** the whole tree is released at once with its root.
+** Nothing in an arena is freed individually; child
+** arrays that are replaced are abandoned. Each block
+** starts with a link to the previous block and its
+** size so the arena can tell what it allocated.
+*/
+
+enum {
+  MPC_ARENA_ALIGN = 8,
+  MPC_ARENA_HEADER = 16,
+  MPC_ARENA_BLOCK_MIN = 4096,
+  MPC_ARENA_BLOCK_MAX = 1 << 20
+};
+
+struct mpc_arena_t {
+  char *block;
+  size_t used;
+  size_t size;
+  mpc_ast_t *root;
+};
+
+static mpc_arena_t *mpc_arena_new(void) {
+  mpc_arena_t *m = malloc(sizeof(mpc_arena_t));
+  m->block = NULL;
+  m->used = 0;
+  m->size = 0;
+  m->root = NULL;
+  return m;
+}
+
+static void mpc_arena_delete(mpc_arena_t *m) {
+  char *b;
+  while (m->block) {
+    b = m->block;
+    m->block = *(char**)b;
+    free(b);
+  }
+  free(m);
+}
+
+static void *mpc_arena_alloc(mpc_arena_t *m, size_t n) {
+
+  char *b;
+  size_t size;
+
+  n = (n + MPC_ARENA_ALIGN - 1) & ~(size_t)(MPC_ARENA_ALIGN - 1);
+
+  if (m->used + n > m->size) {
+    size = m->size ? m->size * 2 : MPC_ARENA_BLOCK_MIN;
+    if (size > MPC_ARENA_BLOCK_MAX) { size = MPC_ARENA_BLOCK_MAX; }
+    if (size < n + MPC_ARENA_HEADER) { size = n + MPC_ARENA_HEADER; }
+    b = malloc(size);
+    *(char**)b = m->block;
+    *(size_t*)(b + sizeof(char*)) = size;
+    m->block = b;
+    m->used = MPC_ARENA_HEADER;
+    m->size = size;
+  }
+
+  b = m->block + m->used;
+  m->used += n;
+  return b;
+}
+
+static int mpc_arena_owns(mpc_arena_t *m, void *p) {
+  char *b;
+  for (b = m->block; b; b = *(char**)b) {
+    if ((char*)p >= b + MPC_ARENA_HEADER
+    &&  (char*)p <  b + *(size_t*)(b + sizeof(char*))) { return 1; }
+  }
+  return 0;
+}
+
+/*
+** Packrat memo entry. The table is direct
+** mapped on (parser, position) so an entry is
+** simply overwritten on collision - this keeps
+** the memory used by one parse bounded.
+*/
+
+typedef struct {
+  mpc_parser_t *parser;
+  long pos;
+  int term;
+  int suppress;
+  int success;
+  mpc_state_t state;
+  char last;
+  mpc_dtor_t dtor;
+  mpc_val_t *output;
+  mpc_err_t *error;
+} mpc_memo_t;
+
+typedef struct mpc_tag_join_t mpc_tag_join_t;
 
 typedef struct {
 
@@ -85,8 +320,17 @@ typedef struct {
   char *buffer;
   FILE *file;
 
+  size_t buffer_slots;
+  long buffer_start;
+  long buffer_end;
+
+  size_t length;
+  void *mapping;
+  size_t mapping_length;
+
   int suppress;
   int backtrack;
+  int commit;
   int marks_slots;
   int marks_num;
   mpc_state_t *marks;
@@ -94,9 +338,24 @@ typedef struct {
   char *lasts;
   char last;
 
-  size_t mem_index;
-  char mem_full[MPC_INPUT_MEM_NUM];
-  mpc_mem_t mem[MPC_INPUT_MEM_NUM];
+  mpc_memo_t *memo;
+  mpc_memo_stats_t memo_stats;
+
+  int lazy;
+  mpc_state_t farthest;
+  int farthest_num;
+  const char **farthest_expected;
+  const char *farthest_failure;
+  char farthest_received;
+
+  int discard;
+  mpc_arena_t *arena;
+  mpc_tag_join_t *joins;
+
+  mpc_pool_t pool;
+
+  struct mpc_frame_t *frames;
+  int frames_slots;
 
 } mpc_input_t;
 
@@ -110,51 +369,92 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
 
   i->state = mpc_state_new();
 
-  i->string = malloc(strlen(string) + 1);
-  strcpy(i->string, string);
+  i->string = (char*)string;
   i->buffer = NULL;
   i->file = NULL;
+  i->buffer_slots = 0;
+  i->buffer_start = 0;
+  i->buffer_end = 0;
+  i->length = strlen(string);
+  i->mapping = NULL;
+  i->mapping_length = 0;
 
   i->suppress = 0;
   i->backtrack = 1;
+  i->commit = 0;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
   i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->memo = NULL;
+  memset(&i->memo_stats, 0, sizeof(mpc_memo_stats_t));
+
+  i->lazy = 0;
+  i->discard = 0;
+  i->arena = NULL;
+  i->joins = NULL;
+  i->farthest = mpc_state_invalid();
+  i->farthest_num = 0;
+  i->farthest_expected = NULL;
+  i->farthest_failure = NULL;
+  i->farthest_received = '\0';
+
+  memset(&i->pool, 0, sizeof(mpc_pool_t));
+
+  i->frames = NULL;
+  i->frames_slots = 0;
 
   return i;
 }
 
-static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *string, size_t length) {
+static mpc_input_t *mpc_input_new_view(const char *filename, const char *string, size_t length) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
 
   i->filename = malloc(strlen(filename) + 1);
   strcpy(i->filename, filename);
-  i->type = MPC_INPUT_STRING;
+  i->type = MPC_INPUT_VIEW;
 
   i->state = mpc_state_new();
 
-  i->string = malloc(length + 1);
-  strncpy(i->string, string, length);
-  i->string[length] = '\0';
+  i->string = (char*)string;
   i->buffer = NULL;
   i->file = NULL;
+  i->buffer_slots = 0;
+  i->buffer_start = 0;
+  i->buffer_end = 0;
+  i->length = length;
+  i->mapping = NULL;
+  i->mapping_length = 0;
 
   i->suppress = 0;
   i->backtrack = 1;
+  i->commit = 0;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
   i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->memo = NULL;
+  memset(&i->memo_stats, 0, sizeof(mpc_memo_stats_t));
+
+  i->lazy = 0;
+  i->discard = 0;
+  i->arena = NULL;
+  i->joins = NULL;
+  i->farthest = mpc_state_invalid();
+  i->farthest_num = 0;
+  i->farthest_expected = NULL;
+  i->farthest_failure = NULL;
+  i->farthest_received = '\0';
+
+  memset(&i->pool, 0, sizeof(mpc_pool_t));
+
+  i->frames = NULL;
+  i->frames_slots = 0;
 
   return i;
 
@@ -171,19 +471,41 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->state = mpc_state_new();
 
   i->string = NULL;
-  i->buffer = NULL;
+  i->buffer = malloc(MPC_INPUT_BUFFER_MIN);
   i->file = pipe;
+  i->buffer_slots = MPC_INPUT_BUFFER_MIN;
+  i->buffer_start = 0;
+  i->buffer_end = 0;
+  i->length = 0;
+  i->mapping = NULL;
+  i->mapping_length = 0;
 
   i->suppress = 0;
   i->backtrack = 1;
+  i->commit = 0;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
   i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->memo = NULL;
+  memset(&i->memo_stats, 0, sizeof(mpc_memo_stats_t));
+
+  i->lazy = 0;
+  i->discard = 0;
+  i->arena = NULL;
+  i->joins = NULL;
+  i->farthest = mpc_state_invalid();
+  i->farthest_num = 0;
+  i->farthest_expected = NULL;
+  i->farthest_failure = NULL;
+  i->farthest_received = '\0';
+
+  memset(&i->pool, 0, sizeof(mpc_pool_t));
+
+  i->frames = NULL;
+  i->frames_slots = 0;
 
   return i;
 
@@ -201,57 +523,280 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->string = NULL;
   i->buffer = NULL;
   i->file = file;
+  i->buffer_slots = 0;
+  i->buffer_start = 0;
+  i->buffer_end = 0;
+  i->length = 0;
+  i->mapping = NULL;
+  i->mapping_length = 0;
 
   i->suppress = 0;
   i->backtrack = 1;
+  i->commit = 0;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
   i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->memo = NULL;
+  memset(&i->memo_stats, 0, sizeof(mpc_memo_stats_t));
+
+  i->lazy = 0;
+  i->discard = 0;
+  i->arena = NULL;
+  i->joins = NULL;
+  i->farthest = mpc_state_invalid();
+  i->farthest_num = 0;
+  i->farthest_expected = NULL;
+  i->farthest_failure = NULL;
+  i->farthest_received = '\0';
+
+  memset(&i->pool, 0, sizeof(mpc_pool_t));
+
+  i->frames = NULL;
+  i->frames_slots = 0;
 
   return i;
 }
 
+static mpc_input_t *mpc_input_new_mmap(const char *filename, FILE *file) {
+
+#ifdef MPC_MMAP
+
+  mpc_input_t *i;
+  struct stat st;
+  long offset;
+  void *mapping;
+
+  offset = ftell(file);
+  if (offset < 0) { return NULL; }
+  if (fstat(fileno(file), &st) != 0) { return NULL; }
+  if (!S_ISREG(st.st_mode) || (long)st.st_size <= offset) { return NULL; }
+
+  mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+  if (mapping == MAP_FAILED) { return NULL; }
+  posix_madvise(mapping, st.st_size, POSIX_MADV_SEQUENTIAL);
+
+  i = malloc(sizeof(mpc_input_t));
+
+  i->filename = malloc(strlen(filename) + 1);
+  strcpy(i->filename, filename);
+  i->type = MPC_INPUT_MMAP;
+  i->state = mpc_state_new();
+
+  i->string = (char*)mapping + offset;
+  i->buffer = NULL;
+  i->file = file;
+  i->buffer_slots = 0;
+  i->buffer_start = 0;
+  i->buffer_end = 0;
+
+  i->length = st.st_size - offset;
+  i->mapping = mapping;
+  i->mapping_length = st.st_size;
+
+  i->suppress = 0;
+  i->backtrack = 1;
+  i->commit = 0;
+  i->marks_num = 0;
+  i->marks_slots = MPC_INPUT_MARKS_MIN;
+  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
+  i->lasts = malloc(sizeof(char) * i->marks_slots);
+  i->last = '\0';
+
+  i->memo = NULL;
+  memset(&i->memo_stats, 0, sizeof(mpc_memo_stats_t));
+
+  i->lazy = 0;
+  i->discard = 0;
+  i->arena = NULL;
+  i->joins = NULL;
+  i->farthest = mpc_state_invalid();
+  i->farthest_num = 0;
+  i->farthest_expected = NULL;
+  i->farthest_failure = NULL;
+  i->farthest_received = '\0';
+
+  memset(&i->pool, 0, sizeof(mpc_pool_t));
+
+  i->frames = NULL;
+  i->frames_slots = 0;
+
+  return i;
+
+#else
+  (void)filename; (void)file;
+  return NULL;
+#endif
+
+}
+
+static void mpc_memo_clear(mpc_memo_t *m) {
+  if (m->parser == NULL) { return; }
+  if (m->output) { m->dtor(m->output); }
+  if (m->error) { mpc_err_delete(m->error); }
+  memset(m, 0, sizeof(mpc_memo_t));
+}
+
+/* Releases everything a parse left behind in the input */
+
+static void mpc_input_clear(mpc_input_t *i) {
+
+  long j;
+
+  if (i->memo) {
+    for (j = 0; j < MPC_INPUT_MEMO_NUM; j++) { mpc_memo_clear(&i->memo[j]); }
+  }
+
+  /* An arena not handed over to a result is released with the input */
+  if (i->arena) {
+    mpc_arena_delete(i->arena);
+    i->arena = NULL;
+  }
+
+  mpc_pool_reset(&i->pool);
+}
+
 static void mpc_input_delete(mpc_input_t *i) {
 
+  long j;
+
   free(i->filename);
 
-  if (i->type == MPC_INPUT_STRING) { free(i->string); }
-  if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
+  if (i->type == MPC_INPUT_PIPE) {
+    for (j = i->buffer_end - 1; j >= i->state.pos; j--) {
+      ungetc((unsigned char)i->buffer[(size_t)j & (i->buffer_slots-1)], i->file);
+    }
+    free(i->buffer);
+  }
 
+#ifdef MPC_MMAP
+  if (i->type == MPC_INPUT_MMAP) {
+    /* Leave the stream just after the consumed input like File does */
+    fseek(i->file, (long)(i->string - (char*)i->mapping) + i->state.pos, SEEK_SET);
+    munmap(i->mapping, i->mapping_length);
+  }
+#endif
+
+  mpc_input_clear(i);
+  free(i->memo);
+
+  for (j = 0; j < i->pool.regions_num; j++) { free(i->pool.regions[j]); }
+
+  free(i->frames);
+  free(i->joins);
+  free(i->farthest_expected);
   free(i->marks);
   free(i->lasts);
   free(i);
 }
 
-static int mpc_mem_ptr(mpc_input_t *i, void *p) {
-  return
-    (char*)p >= (char*)(i->mem) &&
-    (char*)p <  (char*)(i->mem) + (MPC_INPUT_MEM_NUM * sizeof(mpc_mem_t));
+/* Points a String or View input at new contents, keeping its buffers */
+
+static void mpc_input_reuse(mpc_input_t *i, const char *filename, const char *string, size_t length, int type) {
+
+  i->filename = realloc(i->filename, strlen(filename) + 1);
+  strcpy(i->filename, filename);
+  i->type = type;
+
+  i->state = mpc_state_new();
+
+  i->string = (char*)string;
+  i->length = length;
+
+  i->suppress = 0;
+  i->backtrack = 1;
+  i->commit = 0;
+  i->marks_num = 0;
+  i->last = '\0';
+
+  i->lazy = 0;
+  i->discard = 0;
+  i->farthest = mpc_state_invalid();
+  i->farthest_num = 0;
+  i->farthest_failure = NULL;
+  i->farthest_received = '\0';
+
+  memset(&i->memo_stats, 0, sizeof(mpc_memo_stats_t));
+}
+
+/* Bytes given to each class in region `j` */
+
+static size_t mpc_pool_area(int j) {
+  return (size_t)1 << (MPC_POOL_AREA_BITS + j);
 }
 
-static void *mpc_malloc(mpc_input_t *i, size_t n) {
-  size_t j;
-  char *p;
+static size_t mpc_pool_size(int k) {
+  return (size_t)MPC_POOL_CLASS_MIN << k;
+}
 
-  if (n > sizeof(mpc_mem_t)) { return malloc(n); }
+/* Returns the class of a pooled pointer or -1 for any other pointer */
 
-  j = i->mem_index;
-  do {
-    if (!i->mem_full[i->mem_index]) {
-      p = (void*)(i->mem + i->mem_index);
-      i->mem_full[i->mem_index] = 1;
-      i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-      return p;
+static int mpc_pool_class(mpc_pool_t *m, void *p) {
+  int j;
+  for (j = m->regions_num-1; j >= 0; j--) {
+    if ((char*)p >= m->regions[j]
+    &&  (char*)p <  m->regions[j] + mpc_pool_area(j) * MPC_POOL_CLASSES) {
+      return (int)((size_t)((char*)p - m->regions[j]) >> (MPC_POOL_AREA_BITS + j));
     }
-    i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-  } while (j != i->mem_index);
+  }
+  return -1;
+}
+
+/* Gives class `k` its area in the next region, adding one if needed */
+
+static int mpc_pool_refill(mpc_pool_t *m, int k) {
+
+  int j = m->area[k];
+
+  if (j == MPC_POOL_REGIONS) { return 0; }
+
+  if (j == m->regions_num) {
+    m->regions[j] = malloc(mpc_pool_area(j) * MPC_POOL_CLASSES);
+    m->regions_num++;
+  }
 
-  return malloc(n);
+  m->next[k] = m->regions[j] + mpc_pool_area(j) * k;
+  m->end[k] = m->next[k] + mpc_pool_area(j);
+  m->area[k] = j+1;
+  return 1;
+}
+
+static void mpc_pool_release(mpc_pool_t *m, int k, void *p) {
+  *(void**)p = m->free[k];
+  m->free[k] = p;
+}
+
+static void *mpc_malloc(mpc_input_t *i, size_t n) {
+
+  mpc_pool_t *m = &i->pool;
+  void *p;
+  int k = 0;
+
+  while (k < MPC_POOL_CLASSES && mpc_pool_size(k) < n) { k++; }
+
+  if (k == MPC_POOL_CLASSES) {
+    m->stats.fallbacks++;
+    return malloc(n);
+  }
+
+  if (m->free[k]) {
+    p = m->free[k];
+    m->free[k] = *(void**)p;
+    m->stats.hits++;
+    return p;
+  }
+
+  if (m->next[k] == m->end[k] && !mpc_pool_refill(m, k)) {
+    m->stats.misses++;
+    return malloc(n);
+  }
+
+  p = m->next[k];
+  m->next[k] += mpc_pool_size(k);
+  m->stats.hits++;
+  return p;
 }
 
 static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
@@ -261,34 +806,32 @@ static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
 }
 
 static void mpc_free(mpc_input_t *i, void *p) {
-  size_t j;
-  if (!mpc_mem_ptr(i, p)) { free(p); return; }
-  j = ((size_t)(((char*)p) - ((char*)i->mem))) / sizeof(mpc_mem_t);
-  i->mem_full[j] = 0;
+  int k = mpc_pool_class(&i->pool, p);
+  if (k < 0) { free(p); return; }
+  mpc_pool_release(&i->pool, k, p);
 }
 
 static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
 
   char *q = NULL;
+  int k = mpc_pool_class(&i->pool, p);
 
-  if (!mpc_mem_ptr(i, p)) { return realloc(p, n); }
-
-  if (n > sizeof(mpc_mem_t)) {
-    q = malloc(n);
-    memcpy(q, p, sizeof(mpc_mem_t));
-    mpc_free(i, p);
-    return q;
-  }
+  if (k < 0) { return realloc(p, n); }
+  if (n <= mpc_pool_size(k)) { return p; }
 
-  return p;
+  q = mpc_malloc(i, n);
+  memcpy(q, p, mpc_pool_size(k));
+  mpc_pool_release(&i->pool, k, p);
+  return q;
 }
 
 static void *mpc_export(mpc_input_t *i, void *p) {
   char *q = NULL;
-  if (!mpc_mem_ptr(i, p)) { return p; }
-  q = malloc(sizeof(mpc_mem_t));
-  memcpy(q, p, sizeof(mpc_mem_t));
-  mpc_free(i, p);
+  int k = mpc_pool_class(&i->pool, p);
+  if (k < 0) { return p; }
+  q = malloc(mpc_pool_size(k));
+  memcpy(q, p, mpc_pool_size(k));
+  mpc_pool_release(&i->pool, k, p);
   return q;
 }
 
@@ -313,14 +856,9 @@ static void mpc_input_mark(mpc_input_t *i) {
   i->marks[i->marks_num-1] = i->state;
   i->lasts[i->marks_num-1] = i->last;
 
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
-  }
-
 }
 
 static void mpc_input_unmark(mpc_input_t *i) {
-  int j;
 
   if (i->backtrack < 1) { return; }
 
@@ -335,14 +873,6 @@ static void mpc_input_unmark(mpc_input_t *i) {
     i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);
   }
 
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    for (j = strlen(i->buffer) - 1; j >= 0; j--)
-      ungetc(i->buffer[j], i->file);
-
-    free(i->buffer);
-    i->buffer = NULL;
-  }
-
 }
 
 static void mpc_input_rewind(mpc_input_t *i) {
@@ -359,12 +889,52 @@ static void mpc_input_rewind(mpc_input_t *i) {
   mpc_input_unmark(i);
 }
 
-static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (long)(strlen(i->buffer) + i->marks[0].pos);
+static void mpc_input_buffer_grow(mpc_input_t *i) {
+
+  long j;
+  size_t slots = i->buffer_slots * 2;
+  char *buffer = malloc(slots);
+
+  for (j = i->buffer_start; j < i->buffer_end; j++) {
+    buffer[(size_t)j & (slots-1)] = i->buffer[(size_t)j & (i->buffer_slots-1)];
+  }
+
+  free(i->buffer);
+  i->buffer = buffer;
+  i->buffer_slots = slots;
+}
+
+static int mpc_input_buffer_fill(mpc_input_t *i) {
+
+  int c;
+  long n = 0;
+
+  /* Discard anything we can no longer rewind to */
+  if (i->marks_num > 0) {
+    i->buffer_start = i->marks[0].pos < i->state.pos ? i->marks[0].pos : i->state.pos;
+  } else {
+    i->buffer_start = i->state.pos;
+  }
+
+  /* Read up to a block, stopping early at newlines to stay interactive */
+  while (n < MPC_INPUT_BUFFER_BLOCK) {
+    if (i->buffer_end - i->buffer_start == (long)i->buffer_slots) {
+      mpc_input_buffer_grow(i);
+    }
+    c = getc(i->file);
+    if (c == EOF) { break; }
+    i->buffer[(size_t)i->buffer_end & (i->buffer_slots-1)] = (char)c;
+    i->buffer_end++;
+    n++;
+    if (c == '\n') { break; }
+  }
+
+  return n > 0;
 }
 
 static char mpc_input_buffer_get(mpc_input_t *i) {
-  return i->buffer[i->state.pos - i->marks[0].pos];
+  if (i->state.pos >= i->buffer_end && !mpc_input_buffer_fill(i)) { return '\0'; }
+  return i->buffer[(size_t)i->state.pos & (i->buffer_slots-1)];
 }
 
 static char mpc_input_getc(mpc_input_t *i) {
@@ -374,19 +944,10 @@ static char mpc_input_getc(mpc_input_t *i) {
   switch (i->type) {
 
     case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_VIEW:
+    case MPC_INPUT_MMAP: return (size_t)i->state.pos < i->length ? i->string[i->state.pos] : '\0';
     case MPC_INPUT_FILE: c = fgetc(i->file); return c;
-    case MPC_INPUT_PIPE:
-
-      if (!i->buffer) { c = getc(i->file); return c; }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        c = mpc_input_buffer_get(i);
-        return c;
-      } else {
-        c = getc(i->file);
-        return c;
-      }
-
+    case MPC_INPUT_PIPE: return mpc_input_buffer_get(i);
     default: return c;
   }
 }
@@ -397,6 +958,8 @@ static char mpc_input_peekc(mpc_input_t *i) {
 
   switch (i->type) {
     case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_VIEW:
+    case MPC_INPUT_MMAP: return (size_t)i->state.pos < i->length ? i->string[i->state.pos] : '\0';
     case MPC_INPUT_FILE:
 
       c = fgetc(i->file);
@@ -405,48 +968,25 @@ static char mpc_input_peekc(mpc_input_t *i) {
       fseek(i->file, -1, SEEK_CUR);
       return c;
 
-    case MPC_INPUT_PIPE:
-
-      if (!i->buffer) {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        return mpc_input_buffer_get(i);
-      } else {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
-
+    case MPC_INPUT_PIPE: return mpc_input_buffer_get(i);
     default: return c;
   }
 
 }
 
 static int mpc_input_terminated(mpc_input_t *i) {
+  if (i->type == MPC_INPUT_VIEW || i->type == MPC_INPUT_MMAP) {
+    return (size_t)i->state.pos >= i->length;
+  }
   return mpc_input_peekc(i) == '\0';
 }
 
 static int mpc_input_failure(mpc_input_t *i, char c) {
 
+  (void)c;
+
   switch (i->type) {
-    case MPC_INPUT_STRING: { break; }
     case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); { break; }
-    case MPC_INPUT_PIPE: {
-
-      if (!i->buffer) { ungetc(c, i->file); break; }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        break;
-      } else {
-        ungetc(c, i->file);
-      }
-    }
     default: { break; }
   }
   return 0;
@@ -454,13 +994,6 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
 
 static int mpc_input_success(mpc_input_t *i, char c, char **o) {
 
-  if (i->type == MPC_INPUT_PIPE
-  &&  i->buffer && !mpc_input_buffer_in_range(i)) {
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
-  }
-
   i->last = c;
   i->state.pos++;
   i->state.col++;
@@ -470,7 +1003,9 @@ static int mpc_input_success(mpc_input_t *i, char c, char **o) {
     i->state.row++;
   }
 
-  if (o) {
+  if (o && i->discard) {
+    (*o) = NULL;
+  } else if (o) {
     (*o) = mpc_malloc(i, 2);
     (*o)[0] = c;
     (*o)[1] = '\0';
@@ -479,6 +1014,121 @@ static int mpc_input_success(mpc_input_t *i, char c, char **o) {
   return 1;
 }
 
+/*
+** Character classes are 256-bit sets laid out by nibble.
+** Byte `lo` (or `16 + lo` for bytes from 0x80) holds one
+** bit for each high nibble, so a lookup is one shift and
+** the same tables can be used with a byte shuffle to test
+** many bytes at once.
+*/
+
+static void mpc_class_add(unsigned char *set, int c) {
+  c = (unsigned char)c;
+  set[((c >> 3) & 16) | (c & 15)] |= (unsigned char)(1 << ((c >> 4) & 7));
+}
+
+static int mpc_class_has(const unsigned char *set, int c) {
+  c = (unsigned char)c;
+  return (set[((c >> 3) & 16) | (c & 15)] >> ((c >> 4) & 7)) & 1;
+}
+
+static void mpc_class_oneof(unsigned char *set, const char *s) {
+  memset(set, 0, 32);
+  while (*s) { mpc_class_add(set, *s); s++; }
+}
+
+static void mpc_class_noneof(unsigned char *set, const char *s) {
+  int c;
+  memset(set, 0, 32);
+  for (c = 0; c < 256; c++) {
+    if (c == 0 || !strchr(s, c)) { mpc_class_add(set, c); }
+  }
+}
+
+static void mpc_class_range(unsigned char *set, char x, char y) {
+  int c;
+  memset(set, 0, 32);
+  for (c = 0; c < 256; c++) {
+    if ((char)c >= x && (char)c <= y) { mpc_class_add(set, c); }
+  }
+}
+
+/* Number of leading bytes of `s` in the class */
+
+static long mpc_class_span(const unsigned char *set, const char *s, long n) {
+
+  long k = 0;
+
+#if defined(MPC_SIMD_AVX2)
+
+  __m256i lo_tbl = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)set));
+  __m256i hi_tbl = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(set + 16)));
+  __m256i bit_tbl = _mm256_setr_epi8(
+    1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+    1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+  __m256i nib = _mm256_set1_epi8(0x0F);
+  __m256i eight = _mm256_set1_epi8(8);
+  __m256i v, lo, hi, row, sel;
+  unsigned int miss;
+
+  for (; k + 32 <= n; k += 32) {
+    v = _mm256_loadu_si256((const __m256i*)(s + k));
+    lo = _mm256_and_si256(v, nib);
+    hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nib);
+    sel = _mm256_cmpgt_epi8(eight, hi);
+    row = _mm256_or_si256(
+      _mm256_and_si256(sel, _mm256_shuffle_epi8(lo_tbl, lo)),
+      _mm256_andnot_si256(sel, _mm256_shuffle_epi8(hi_tbl, lo)));
+    row = _mm256_and_si256(row, _mm256_shuffle_epi8(bit_tbl, hi));
+    miss = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(row, _mm256_setzero_si256()));
+    if (miss) { return k + __builtin_ctz(miss); }
+  }
+
+#elif defined(MPC_SIMD_SSSE3)
+
+  __m128i lo_tbl = _mm_loadu_si128((const __m128i*)set);
+  __m128i hi_tbl = _mm_loadu_si128((const __m128i*)(set + 16));
+  __m128i bit_tbl = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+  __m128i nib = _mm_set1_epi8(0x0F);
+  __m128i eight = _mm_set1_epi8(8);
+  __m128i v, lo, hi, row, sel;
+  unsigned int miss;
+
+  for (; k + 16 <= n; k += 16) {
+    v = _mm_loadu_si128((const __m128i*)(s + k));
+    lo = _mm_and_si128(v, nib);
+    hi = _mm_and_si128(_mm_srli_epi16(v, 4), nib);
+    sel = _mm_cmpgt_epi8(eight, hi);
+    row = _mm_or_si128(
+      _mm_and_si128(sel, _mm_shuffle_epi8(lo_tbl, lo)),
+      _mm_andnot_si128(sel, _mm_shuffle_epi8(hi_tbl, lo)));
+    row = _mm_and_si128(row, _mm_shuffle_epi8(bit_tbl, hi));
+    miss = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(row, _mm_setzero_si128()));
+    if (miss) { return k + __builtin_ctz(miss); }
+  }
+
+#endif
+
+  while (k < n && mpc_class_has(set, s[k])) { k++; }
+  return k;
+}
+
+static int mpc_input_contiguous(mpc_input_t *i) {
+  return i->type == MPC_INPUT_STRING
+      || i->type == MPC_INPUT_VIEW
+      || i->type == MPC_INPUT_MMAP;
+}
+
+/*
+** Length of the run of class bytes at the current
+** position, or -1 if the input is not held in memory.
+*/
+
+static long mpc_input_span(mpc_input_t *i, const unsigned char *set) {
+  if (!mpc_input_contiguous(i)) { return -1; }
+  return mpc_class_span(set, i->string + i->state.pos, (long)i->length - i->state.pos);
+}
+
 static int mpc_input_any(mpc_input_t *i, char **o) {
   char x;
   if (mpc_input_terminated(i)) { return 0; }
@@ -493,25 +1143,62 @@ static int mpc_input_char(mpc_input_t *i, char c, char **o) {
   return x == c ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
 }
 
-static int mpc_input_range(mpc_input_t *i, char c, char d, char **o) {
+static int mpc_input_class(mpc_input_t *i, const unsigned char *set, char **o) {
   char x;
   if (mpc_input_terminated(i)) { return 0; }
   x = mpc_input_getc(i);
-  return x >= c && x <= d ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
+  return mpc_class_has(set, x) ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
 }
 
-static int mpc_input_oneof(mpc_input_t *i, const char *c, char **o) {
-  char x;
-  if (mpc_input_terminated(i)) { return 0; }
-  x = mpc_input_getc(i);
-  return strchr(c, x) != 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
+/*
+** Consumes the run of class bytes at the current
+** position and returns it as a single string.
+*/
+
+static char *mpc_input_run(mpc_input_t *i, const unsigned char *set, long *n) {
+
+  long k, slots;
+  char *s;
+
+  k = mpc_input_span(i, set);
+
+  if (i->discard) {
+    if (k >= 0) {
+      for (*n = 0; *n < k; (*n)++) { mpc_input_success(i, i->string[i->state.pos], NULL); }
+    } else {
+      for (*n = 0; mpc_input_class(i, set, NULL); (*n)++);
+    }
+    return NULL;
+  }
+
+  if (k >= 0) {
+    s = mpc_malloc(i, k + 1);
+    memcpy(s, i->string + i->state.pos, k);
+    s[k] = '\0';
+    for (*n = 0; *n < k; (*n)++) { mpc_input_success(i, s[*n], NULL); }
+    return s;
+  }
+
+  slots = 16;
+  s = mpc_malloc(i, slots);
+  k = 0;
+  while (mpc_input_class(i, set, NULL)) {
+    if (k + 1 == slots) { slots *= 2; s = mpc_realloc(i, s, slots); }
+    s[k++] = i->last;
+  }
+  s[k] = '\0';
+  *n = k;
+  return s;
 }
 
-static int mpc_input_noneof(mpc_input_t *i, const char *c, char **o) {
-  char x;
-  if (mpc_input_terminated(i)) { return 0; }
-  x = mpc_input_getc(i);
-  return strchr(c, x) == 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
+/* Copies out the input matched since `pos` */
+
+static char *mpc_input_slice(mpc_input_t *i, long pos) {
+  long k = i->state.pos - pos;
+  char *s = mpc_malloc(i, k + 1);
+  memcpy(s, i->string + pos, k);
+  s[k] = '\0';
+  return s;
 }
 
 static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
@@ -535,6 +1222,8 @@ static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
   }
   mpc_input_unmark(i);
 
+  if (i->discard) { *o = NULL; return 1; }
+
   *o = mpc_malloc(i, strlen(c) + 1);
   strcpy(*o, c);
   return 1;
@@ -662,9 +1351,42 @@ char *mpc_err_string(mpc_err_t *x) {
   return realloc(buffer, strlen(buffer) + 1);
 }
 
+/*
+** When errors are lazy only the farthest failure is
+** kept, as the messages of the parsers which failed
+** there. An mpc_err_t is built from it only once the
+** whole parse has failed.
+*/
+
+static void mpc_err_track(mpc_input_t *i, const char *expected, const char *failure) {
+
+  int j;
+
+  if (i->state.pos < i->farthest.pos) { return; }
+
+  if (i->state.pos > i->farthest.pos) {
+    i->farthest = i->state;
+    i->farthest_num = 0;
+    i->farthest_failure = NULL;
+    i->farthest_received = mpc_input_peekc(i);
+  }
+
+  if (i->farthest_failure) { return; }
+  if (failure) { i->farthest_failure = failure; return; }
+
+  for (j = 0; j < i->farthest_num; j++) {
+    if (i->farthest_expected[j] == expected) { return; }
+  }
+
+  i->farthest_num++;
+  i->farthest_expected = realloc(i->farthest_expected, sizeof(char*) * i->farthest_num);
+  i->farthest_expected[i->farthest_num-1] = expected;
+}
+
 static mpc_err_t *mpc_err_new(mpc_input_t *i, const char *expected) {
   mpc_err_t *x;
   if (i->suppress) { return NULL; }
+  if (i->lazy) { mpc_err_track(i, expected, NULL); return NULL; }
   x = mpc_malloc(i, sizeof(mpc_err_t));
   x->filename = mpc_malloc(i, strlen(i->filename) + 1);
   strcpy(x->filename, i->filename);
@@ -681,6 +1403,7 @@ static mpc_err_t *mpc_err_new(mpc_input_t *i, const char *expected) {
 static mpc_err_t *mpc_err_fail(mpc_input_t *i, const char *failure) {
   mpc_err_t *x;
   if (i->suppress) { return NULL; }
+  if (i->lazy) { mpc_err_track(i, NULL, failure); return NULL; }
   x = mpc_malloc(i, sizeof(mpc_err_t));
   x->filename = mpc_malloc(i, strlen(i->filename) + 1);
   strcpy(x->filename, i->filename);
@@ -728,6 +1451,29 @@ static mpc_err_t *mpc_err_export(mpc_input_t *i, mpc_err_t *x) {
   return mpc_export(i, x);
 }
 
+static mpc_err_t *mpc_err_copy(mpc_err_t *x) {
+  int j;
+  mpc_err_t *y;
+  if (x == NULL) { return NULL; }
+  y = malloc(sizeof(mpc_err_t));
+  y->state = x->state;
+  y->received = x->received;
+  y->filename = malloc(strlen(x->filename) + 1);
+  strcpy(y->filename, x->filename);
+  y->failure = NULL;
+  if (x->failure) {
+    y->failure = malloc(strlen(x->failure) + 1);
+    strcpy(y->failure, x->failure);
+  }
+  y->expected_num = x->expected_num;
+  y->expected = x->expected_num ? malloc(sizeof(char*) * x->expected_num) : NULL;
+  for (j = 0; j < x->expected_num; j++) {
+    y->expected[j] = malloc(strlen(x->expected[j]) + 1);
+    strcpy(y->expected[j], x->expected[j]);
+  }
+  return y;
+}
+
 static int mpc_err_contains_expected(mpc_input_t *i, mpc_err_t *x, char *expected) {
   int j;
   (void)i;
@@ -878,6 +1624,37 @@ static mpc_err_t *mpc_err_merge(mpc_input_t *i, mpc_err_t *x, mpc_err_t *y) {
   return mpc_err_or(i, errs, 2);
 }
 
+static mpc_err_t *mpc_err_farthest(mpc_input_t *i) {
+
+  int j;
+  mpc_err_t *x;
+
+  if (i->farthest_num == 0 && !i->farthest_failure) { return NULL; }
+
+  x = mpc_malloc(i, sizeof(mpc_err_t));
+  x->filename = mpc_malloc(i, strlen(i->filename) + 1);
+  strcpy(x->filename, i->filename);
+  x->state = i->farthest;
+  x->expected_num = 0;
+  x->expected = NULL;
+  x->failure = NULL;
+  x->received = i->farthest_received;
+
+  if (i->farthest_failure) {
+    x->failure = mpc_malloc(i, strlen(i->farthest_failure) + 1);
+    strcpy(x->failure, i->farthest_failure);
+    return x;
+  }
+
+  for (j = 0; j < i->farthest_num; j++) {
+    if (!mpc_err_contains_expected(i, x, (char*)i->farthest_expected[j])) {
+      mpc_err_add_expected(i, x, (char*)i->farthest_expected[j]);
+    }
+  }
+
+  return x;
+}
+
 /*
 ** Parser Type
 */
@@ -918,7 +1695,14 @@ enum {
   MPC_TYPE_SOI        = 27,
   MPC_TYPE_EOI        = 28,
 
-  MPC_TYPE_SEPBY1     = 29
+  MPC_TYPE_SEPBY1     = 29,
+
+  MPC_TYPE_MEMO       = 30,
+  MPC_TYPE_LAZY       = 31,
+  MPC_TYPE_RUN        = 32,
+  MPC_TYPE_TOKEN      = 33,
+  MPC_TYPE_SPAN       = 34,
+  MPC_TYPE_ARENA      = 35
 };
 
 typedef struct { char *m; } mpc_pdata_fail_t;
@@ -926,19 +1710,24 @@ typedef struct { mpc_ctor_t lf; void *x; } mpc_pdata_lift_t;
 typedef struct { mpc_parser_t *x; char *m; } mpc_pdata_expect_t;
 typedef struct { int(*f)(char,char); } mpc_pdata_anchor_t;
 typedef struct { char x; } mpc_pdata_single_t;
-typedef struct { char x; char y; } mpc_pdata_range_t;
+typedef struct { char x; char y; unsigned char set[32]; } mpc_pdata_range_t;
 typedef struct { int(*f)(char); } mpc_pdata_satisfy_t;
-typedef struct { char *x; } mpc_pdata_string_t;
+typedef struct { char *x; unsigned char set[32]; } mpc_pdata_string_t;
 typedef struct { mpc_parser_t *x; mpc_apply_t f; } mpc_pdata_apply_t;
 typedef struct { mpc_parser_t *x; mpc_apply_to_t f; void *d; } mpc_pdata_apply_to_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_check_t f; char *e; } mpc_pdata_check_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_check_with_t f; void *d; char *e; } mpc_pdata_check_with_t;
-typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
+typedef struct { mpc_parser_t *x; int restore; } mpc_pdata_predict_t;
+typedef struct { mpc_parser_t *x; } mpc_pdata_lazy_t;
+typedef struct { mpc_parser_t *x; } mpc_pdata_arena_t;
+typedef struct { unsigned char set[32]; char *m; int min; } mpc_pdata_run_t;
+typedef struct { mpc_parser_t *x; mpc_dtor_t dx; int token; } mpc_pdata_span_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
-typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
+typedef struct { int n; mpc_parser_t **xs; unsigned char *dispatch; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_parser_t *sep; } mpc_pdata_sepby1;
+typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_copy_t cx; } mpc_pdata_memo_t;
 
 typedef union {
   mpc_pdata_fail_t fail;
@@ -959,6 +1748,11 @@ typedef union {
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
   mpc_pdata_sepby1 sepby1;
+  mpc_pdata_memo_t memo;
+  mpc_pdata_lazy_t lazy;
+  mpc_pdata_run_t run;
+  mpc_pdata_span_t span;
+  mpc_pdata_arena_t arena;
 } mpc_pdata_t;
 
 struct mpc_parser_t {
@@ -968,6 +1762,24 @@ struct mpc_parser_t {
   char retained;
 };
 
+/*
+** Entries of an `or` dispatch table are the index
+** plus one of the only alternative that can start
+** with that byte, or one of these.
+*/
+
+enum {
+  MPC_DISPATCH_NONE = 0,
+  MPC_DISPATCH_MANY = 255
+};
+
+static mpc_tag_join_t *mpc_input_joins(mpc_input_t *i);
+static mpc_ast_t *mpc_ast_new_arena(mpc_arena_t *m, mpc_tag_join_t *c, const char *tag, const char *contents);
+static mpc_ast_t *mpc_ast_set_tag(mpc_tag_join_t *c, mpc_ast_t *a, const char *t);
+static mpc_ast_t *mpc_ast_join_tag(mpc_tag_join_t *c, mpc_ast_t *a, const char *t);
+static mpc_ast_t *mpc_ast_root(mpc_tag_join_t *c, mpc_ast_t *a);
+static mpc_val_t *mpc_ast_fold(mpc_arena_t *m, mpc_tag_join_t *c, int n, mpc_val_t **xs);
+
 static mpc_val_t *mpcf_input_nth_free(mpc_input_t *i, int n, mpc_val_t **xs, int x) {
   int j;
   for (j = 0; j < n; j++) { if (j != x) { mpc_free(i, xs[j]); } }
@@ -997,8 +1809,13 @@ static mpc_val_t *mpcf_input_state_ast(mpc_input_t *i, int n, mpc_val_t **xs) {
   return a;
 }
 
+static mpc_val_t *mpcf_input_fold_ast(mpc_input_t *i, int n, mpc_val_t **xs) {
+  return mpc_ast_fold(i->arena, mpc_input_joins(i), n, xs);
+}
+
 static mpc_val_t *mpc_parse_fold(mpc_input_t *i, mpc_fold_t f, int n, mpc_val_t **xs) {
   int j;
+  if (i->discard)          { return NULL; }
   if (f == mpcf_null)      { return mpcf_null(n, xs); }
   if (f == mpcf_fst)       { return mpcf_fst(n, xs); }
   if (f == mpcf_snd)       { return mpcf_snd(n, xs); }
@@ -1008,6 +1825,7 @@ static mpc_val_t *mpc_parse_fold(mpc_input_t *i, mpc_fold_t f, int n, mpc_val_t
   if (f == mpcf_trd_free)  { return mpcf_input_trd_free(i, n, xs); }
   if (f == mpcf_strfold)   { return mpcf_input_strfold(i, n, xs); }
   if (f == mpcf_state_ast) { return mpcf_input_state_ast(i, n, xs); }
+  if (f == mpcf_fold_ast)  { return mpcf_input_fold_ast(i, n, xs); }
   for (j = 0; j < n; j++) { xs[j] = mpc_export(i, xs[j]); }
   return f(j, xs);
 }
@@ -1018,7 +1836,7 @@ static mpc_val_t *mpcf_input_free(mpc_input_t *i, mpc_val_t *x) {
 }
 
 static mpc_val_t *mpcf_input_str_ast(mpc_input_t *i, mpc_val_t *c) {
-  mpc_ast_t *a = mpc_ast_new("", c);
+  mpc_ast_t *a = mpc_ast_new_arena(i->arena, mpc_input_joins(i), "", c);
   mpc_free(i, c);
   return a;
 }
@@ -1026,328 +1844,693 @@ static mpc_val_t *mpcf_input_str_ast(mpc_input_t *i, mpc_val_t *c) {
 static mpc_val_t *mpc_parse_apply(mpc_input_t *i, mpc_apply_t f, mpc_val_t *x) {
   if (f == mpcf_free)     { return mpcf_input_free(i, x); }
   if (f == mpcf_str_ast)  { return mpcf_input_str_ast(i, x); }
+  if (f == (mpc_apply_t)mpc_ast_add_root) {
+    return mpc_ast_root(mpc_input_joins(i), mpc_export(i, x));
+  }
   return f(mpc_export(i, x));
 }
 
+/* Tags added while parsing go through the join cache of the input */
+
 static mpc_val_t *mpc_parse_apply_to(mpc_input_t *i, mpc_apply_to_t f, mpc_val_t *x, mpc_val_t *d) {
+  if (f == (mpc_apply_to_t)mpc_ast_tag) {
+    return mpc_ast_set_tag(mpc_input_joins(i), mpc_export(i, x), d);
+  }
+  if (f == (mpc_apply_to_t)mpc_ast_add_tag) {
+    return mpc_ast_join_tag(mpc_input_joins(i), mpc_export(i, x), d);
+  }
   return f(mpc_export(i, x), d);
 }
 
 static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
+  if (i->discard) { return; }
   if (d == free) { mpc_free(i, x); return; }
   d(mpc_export(i, x));
 }
 
+/* The destructor for results of a known fold, NULL if unknown */
+static mpc_dtor_t mpc_fold_dtor(mpc_fold_t f) {
+  if (f == mpcf_strfold) { return free; }
+  if (f == mpcf_fold_ast) { return (mpc_dtor_t)mpc_ast_delete; }
+  return NULL;
+}
+
 enum {
-  MPC_PARSE_STACK_MIN = 4
+  MPC_PARSE_STACK_MIN = 4,
+  MPC_PARSE_FRAMES_MIN = 64
 };
 
-#define MPC_SUCCESS(x) r->output = x; return 1
-#define MPC_FAILURE(x) r->error = x; return 0
-#define MPC_PRIMITIVE(x) \
-  if (x) { MPC_SUCCESS(r->output); } \
-  else { MPC_FAILURE(NULL); }
+/*
+** Parsers are run by a loop over an explicit
+** stack of frames kept on the heap rather than
+** by recursing on the C stack, so deeply nested
+** input can be parsed. The frame limit is only
+** there to catch runaway left recursion.
+*/
 
-#define MPC_MAX_RECURSION_DEPTH 1000
+#define MPC_MAX_RECURSION_DEPTH (1 << 20)
 
-static mpc_result_t *mpc_grow_results(mpc_input_t *i, int j, mpc_result_t *results_stk, mpc_result_t *results){
-  mpc_result_t *tmp_results = results;
+typedef struct mpc_frame_t {
+  mpc_parser_t *p;
+  int j;
+  int phase;
+  int results_slots;
+  mpc_result_t *results;
+  mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
+  mpc_state_t state;
+  int suppress;
+  int dispatched;
+} mpc_frame_t;
+
+typedef struct {
+  int num;
+  int slots;
+  mpc_frame_t *frames;
+} mpc_stack_t;
+
+static mpc_frame_t *mpc_stack_push(mpc_stack_t *s, mpc_parser_t *p) {
+
+  mpc_frame_t *f;
+
+  if (s->num == MPC_MAX_RECURSION_DEPTH) { return NULL; }
 
-  if (j == MPC_PARSE_STACK_MIN) {
-    int results_slots = j + j / 2;
-    tmp_results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-    memcpy(tmp_results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-  } else if (j >= MPC_PARSE_STACK_MIN) {
-    int results_slots = j + j / 2;
-    tmp_results = mpc_realloc(i, tmp_results, sizeof(mpc_result_t) * results_slots);
+  if (s->num == s->slots) {
+    s->slots = s->slots * 2;
+    s->frames = realloc(s->frames, sizeof(mpc_frame_t) * s->slots);
   }
 
-  return tmp_results;
+  f = &s->frames[s->num++];
+  f->p = p;
+  f->j = 0;
+  f->phase = 0;
+  f->results_slots = MPC_PARSE_STACK_MIN;
+  f->results = NULL;
+  return f;
 }
 
-static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
+static mpc_result_t *mpc_frame_results(mpc_frame_t *f) {
+  return f->results ? f->results : f->results_stk;
+}
 
-  int j = 0, k = 0;
-  mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
-  mpc_result_t *results;
+static void mpc_frame_reserve(mpc_input_t *i, mpc_frame_t *f, int n) {
 
-  if (depth == MPC_MAX_RECURSION_DEPTH)
-  {
-    MPC_FAILURE(mpc_err_fail(i, "Maximum recursion depth exceeded!"));
+  if (n <= f->results_slots) { return; }
+
+  if (f->results == NULL) {
+    f->results_slots = n + n / 2;
+    f->results = mpc_malloc(i, sizeof(mpc_result_t) * f->results_slots);
+    memcpy(f->results, f->results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
+  } else {
+    f->results_slots = n + n / 2;
+    f->results = mpc_realloc(i, f->results, sizeof(mpc_result_t) * f->results_slots);
   }
+}
 
+static const unsigned char *mpc_class_of(mpc_parser_t *p) {
+  if (p->type == MPC_TYPE_EXPECT) { p = p->data.expect.x; }
   switch (p->type) {
+    case MPC_TYPE_RANGE:  return p->data.range.set;
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF: return p->data.string.set;
+    default: return NULL;
+  }
+}
 
-    /* Basic Parsers */
-
-    case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&r->output));
-    case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&r->output));
-    case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, (char**)&r->output));
-    case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_oneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_noneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&r->output));
-    case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
-    case MPC_TYPE_SOI:     MPC_PRIMITIVE(mpc_input_soi(i, (char**)&r->output));
-    case MPC_TYPE_EOI:     MPC_PRIMITIVE(mpc_input_eoi(i, (char**)&r->output));
-
-    /* Other parsers */
-
-    case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
-    case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
-    case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i, p->data.fail.m));
-    case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
-    case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
-    case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i));
-
-    /* Application Parsers */
-
-    case MPC_TYPE_APPLY:
-      if (mpc_parse_run(i, p->data.apply.x, r, e, depth+1)) {
-        MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, r->output));
-      } else {
-        MPC_FAILURE(r->output);
-      }
+static mpc_memo_t *mpc_input_memo_slot(mpc_input_t *i, mpc_parser_t *p, long pos) {
+  size_t h;
+  if (i->memo == NULL) { i->memo = calloc(MPC_INPUT_MEMO_NUM, sizeof(mpc_memo_t)); }
+  h = ((size_t)p >> 4) * 31 + (size_t)pos * 2654435761u;
+  return &i->memo[h & (MPC_INPUT_MEMO_NUM-1)];
+}
 
-    case MPC_TYPE_APPLY_TO:
-      if (mpc_parse_run(i, p->data.apply_to.x, r, e, depth+1)) {
-        MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, r->output, p->data.apply_to.d));
-      } else {
-        MPC_FAILURE(r->error);
-      }
+static int mpc_parse_memo_find(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, int *x) {
 
-    case MPC_TYPE_CHECK:
-      if (mpc_parse_run(i, p->data.check.x, r, e, depth+1)) {
-        if (p->data.check.f(&r->output)) {
-          MPC_SUCCESS(r->output);
-        } else {
-          mpc_parse_dtor(i, p->data.check.dx, r->output);
-          MPC_FAILURE(mpc_err_fail(i, p->data.check.e));
-        }
-      } else {
-        MPC_FAILURE(r->error);
-      }
+  mpc_pdata_memo_t *d = &p->data.memo;
+  mpc_memo_t *m = mpc_input_memo_slot(i, p, i->state.pos);
 
-    case MPC_TYPE_CHECK_WITH:
-      if (mpc_parse_run(i, p->data.check_with.x, r, e, depth+1)) {
-        if (p->data.check_with.f(&r->output, p->data.check_with.d)) {
-          MPC_SUCCESS(r->output);
-        } else {
-          mpc_parse_dtor(i, p->data.check.dx, r->output);
-          MPC_FAILURE(mpc_err_fail(i, p->data.check_with.e));
-        }
-      } else {
-        MPC_FAILURE(r->error);
-      }
+  if (m->parser != p
+  ||  m->pos != i->state.pos
+  ||  m->term != i->state.term
+  ||  m->suppress != (i->suppress > 0)) {
+    i->memo_stats.misses++;
+    return 0;
+  }
 
-    case MPC_TYPE_EXPECT:
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.expect.x, r, e, depth+1)) {
-        mpc_input_suppress_disable(i);
-        MPC_SUCCESS(r->output);
-      } else {
-        mpc_input_suppress_disable(i);
-        MPC_FAILURE(mpc_err_new(i, p->data.expect.m));
-      }
+  i->memo_stats.hits++;
+  i->state = m->state;
+  i->last = m->last;
+  if (i->type == MPC_INPUT_FILE) { fseek(i->file, i->state.pos, SEEK_SET); }
 
-    case MPC_TYPE_PREDICT:
-      mpc_input_backtrack_disable(i);
-      if (mpc_parse_run(i, p->data.predict.x, r, e, depth+1)) {
-        mpc_input_backtrack_enable(i);
-        MPC_SUCCESS(r->output);
-      } else {
-        mpc_input_backtrack_enable(i);
-        MPC_FAILURE(r->error);
-      }
+  if (m->success) {
+    r->output = m->output ? d->cx(m->output) : NULL;
+  } else {
+    r->error = mpc_err_copy(m->error);
+  }
 
-    /* Optional Parsers */
+  *x = m->success;
+  return 1;
+}
 
-    /* TODO: Update Not Error Message */
+static void mpc_parse_memo_store(mpc_input_t *i, mpc_frame_t *f, int x, mpc_result_t *r) {
 
-    case MPC_TYPE_NOT:
-      mpc_input_mark(i);
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.not.x, r, e, depth+1)) {
-        mpc_input_rewind(i);
-        mpc_input_suppress_disable(i);
-        mpc_parse_dtor(i, p->data.not.dx, r->output);
-        MPC_FAILURE(mpc_err_new(i, "opposite"));
-      } else {
-        mpc_input_unmark(i);
-        mpc_input_suppress_disable(i);
-        MPC_SUCCESS(p->data.not.lf());
-      }
+  mpc_pdata_memo_t *d = &f->p->data.memo;
+  mpc_memo_t *m = mpc_input_memo_slot(i, f->p, f->state.pos);
 
-    case MPC_TYPE_MAYBE:
-      if (mpc_parse_run(i, p->data.not.x, r, e, depth+1)) {
-        MPC_SUCCESS(r->output);
-      } else {
-        *e = mpc_err_merge(i, *e, r->error);
-        MPC_SUCCESS(p->data.not.lf());
-      }
+  if (m->parser) { i->memo_stats.evictions++; }
+  mpc_memo_clear(m);
 
-    /* Repeat Parsers */
+  m->parser = f->p;
+  m->pos = f->state.pos;
+  m->term = f->state.term;
+  m->suppress = f->suppress;
+  m->success = x;
+  m->state = i->state;
+  m->last = i->last;
+  m->dtor = d->dx;
+  m->output = x && r->output ? d->cx(r->output) : NULL;
+  m->error = x ? NULL : mpc_err_copy(r->error);
+}
 
-    case MPC_TYPE_MANY:
+#define MPC_SUCCESS(v) { y.output = (v); x = 1; goto pop; }
+#define MPC_FAILURE(v) { y.error = (v); x = 0; goto pop; }
+#define MPC_PRIMITIVE(v) \
+  if (v) { x = 1; goto pop; } \
+  else { MPC_FAILURE(NULL); }
+#define MPC_CALL(q) \
+  if (mpc_stack_push(&s, (q))) { ret = 0; continue; } \
+  else { y.error = mpc_err_fail(i, "Maximum recursion depth exceeded!"); x = 0; ret = 1; continue; }
+
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *root, mpc_result_t *r, mpc_err_t **e) {
+
+  int x = 0, k;
+  int ret = 0;
+  long n;
+  char *str;
+  mpc_span_t *span;
+  const unsigned char *set;
+  mpc_dtor_t dx;
+  mpc_result_t y;
+  mpc_result_t *rs;
+  mpc_frame_t *f;
+  mpc_parser_t *p;
+  mpc_stack_t s;
 
-      results = results_stk;
+  /* The frame stack is kept with the input so it can be reused */
+  s.num = 0;
+  s.slots = i->frames ? i->frames_slots : MPC_PARSE_FRAMES_MIN;
+  s.frames = i->frames ? i->frames : malloc(sizeof(mpc_frame_t) * s.slots);
+  mpc_stack_push(&s, root);
 
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-        j++;
-        results = mpc_grow_results(i, j, results_stk, results);
-      }
+  y.output = NULL;
 
-      *e = mpc_err_merge(i, *e, results[j].error);
+  while (1) {
 
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-        if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+    f = &s.frames[s.num-1];
+    p = f->p;
 
-    case MPC_TYPE_MANY1:
+    /* Entering a parser */
 
-      results = results_stk;
+    if (!ret) {
 
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-        j++;
-        results = mpc_grow_results(i, j, results_stk, results);
-      }
+      switch (p->type) {
 
-      if (j == 0) {
-        MPC_FAILURE(
-          mpc_err_many1(i, results[j].error);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
+        /* Basic Parsers */
+
+        case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&y.output));
+        case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&y.output));
+        case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_class(i, p->data.range.set, (char**)&y.output));
+        case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_class(i, p->data.string.set, (char**)&y.output));
+        case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_class(i, p->data.string.set, (char**)&y.output));
+        case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&y.output));
+        case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&y.output));
+        case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&y.output));
+        case MPC_TYPE_SOI:     MPC_PRIMITIVE(mpc_input_soi(i, (char**)&y.output));
+        case MPC_TYPE_EOI:     MPC_PRIMITIVE(mpc_input_eoi(i, (char**)&y.output));
+
+        /* Other parsers */
 
-        *e = mpc_err_merge(i, *e, results[j].error);
+        case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
+        case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
+        case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i, p->data.fail.m));
+        case MPC_TYPE_LIFT:      MPC_SUCCESS(i->discard ? NULL : p->data.lift.lf());
+        case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
+
+        case MPC_TYPE_RUN:
+          str = mpc_input_run(i, p->data.run.set, &n);
+          y.error = p->data.run.m ? mpc_err_new(i, p->data.run.m) : NULL;
+          if (n < p->data.run.min) {
+            mpc_free(i, str);
+            MPC_FAILURE(mpc_err_many1(i, y.error));
+          }
+          *e = mpc_err_merge(i, *e, y.error);
+          MPC_SUCCESS(str);
+
+        case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i));
+
+        /* Token Parsers */
+
+        case MPC_TYPE_TOKEN:
+          /*
+          ** The match can only be copied out of input held in memory,
+          ** and only with backtracking, as otherwise a failed sub-parser
+          ** may leave input consumed that is not part of the match.
+          */
+          if (i->discard || i->backtrack < 1 || !mpc_input_contiguous(i)) {
+            MPC_CALL(p->data.span.x);
+          }
+          f->phase = 1;
+          f->state = i->state;
+          i->discard++;
+          MPC_CALL(p->data.span.x);
+
+        case MPC_TYPE_SPAN:
+          f->state = i->state;
+          if (p->data.span.token) { i->discard++; }
+          MPC_CALL(p->data.span.x);
+
+        /* Application Parsers */
+
+        case MPC_TYPE_APPLY:      MPC_CALL(p->data.apply.x);
+        case MPC_TYPE_APPLY_TO:   MPC_CALL(p->data.apply_to.x);
+        case MPC_TYPE_CHECK:      MPC_CALL(p->data.check.x);
+        case MPC_TYPE_CHECK_WITH: MPC_CALL(p->data.check_with.x);
+
+        case MPC_TYPE_EXPECT:
+          mpc_input_suppress_enable(i);
+          MPC_CALL(p->data.expect.x);
+
+        case MPC_TYPE_PREDICT:
+          /* Lazy errors record every failure so are only right with backtracking */
+          if (p->data.predict.restore && i->lazy) {
+            mpc_input_mark(i);
+            f->phase = 1;
+            MPC_CALL(p->data.predict.x);
+          }
+          if (p->data.predict.restore) {
+            mpc_input_mark(i);
+            f->state = i->state;
+            i->commit++;
+          }
+          mpc_input_backtrack_disable(i);
+          MPC_CALL(p->data.predict.x);
+
+        case MPC_TYPE_LAZY:
+          i->lazy++;
+          MPC_CALL(p->data.lazy.x);
+
+        case MPC_TYPE_ARENA:
+          if (i->arena == NULL) { i->arena = mpc_arena_new(); }
+          MPC_CALL(p->data.arena.x);
+
+        case MPC_TYPE_MEMO:
+          /* Without backtracking a hit could not restore the input so just run */
+          if (i->backtrack < 1) { MPC_CALL(p->data.memo.x); }
+          if (mpc_parse_memo_find(i, p, &y, &x)) { goto pop; }
+          f->phase = 1;
+          f->state = i->state;
+          f->suppress = i->suppress > 0;
+          MPC_CALL(p->data.memo.x);
+
+        /* Optional Parsers */
+
+        case MPC_TYPE_NOT:
+          mpc_input_mark(i);
+          mpc_input_suppress_enable(i);
+          MPC_CALL(p->data.not.x);
+
+        case MPC_TYPE_MAYBE:
+          if (i->commit) { f->state = i->state; }
+          MPC_CALL(p->data.not.x);
+
+        /* Repeat Parsers */
+
+        case MPC_TYPE_MANY:
+        case MPC_TYPE_MANY1:
+
+          /* A run of class characters in memory is matched in one scan */
+
+          set = mpc_class_of(p->data.repeat.x);
+          if (set == NULL || (n = mpc_input_span(i, set)) < 0) {
+            if (i->commit) { f->state = i->state; }
+            MPC_CALL(p->data.repeat.x);
+          }
+
+          mpc_frame_reserve(i, f, (int)n+1);
+          rs = mpc_frame_results(f);
+          for (k = 0; k < n; k++) {
+            mpc_input_success(i, i->string[i->state.pos], (char**)&rs[k].output);
+          }
+
+          f->j = (int)n;
+          f->state = i->state;
+          x = 0;
+          y.error = p->data.repeat.x->type == MPC_TYPE_EXPECT
+            ? mpc_err_new(i, p->data.repeat.x->data.expect.m) : NULL;
+          break;
+
+        case MPC_TYPE_SEPBY1: MPC_CALL(p->data.sepby1.x);
+
+        case MPC_TYPE_COUNT:
+          mpc_frame_reserve(i, f, p->data.repeat.n);
+          MPC_CALL(p->data.repeat.x);
+
+        /* Combinatory Parsers */
+
+        case MPC_TYPE_OR:
+          if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
+
+          f->state = i->state;
+
+          /*
+          ** Lazy errors are tracked in the order they happen so
+          ** dispatching would reorder them. Eager errors recorded
+          ** so far are held in rs[1] while the dispatched one runs.
+          */
+
+          if (p->data.or.dispatch && (i->suppress || !i->lazy)) {
+            k = p->data.or.dispatch[(unsigned char)mpc_input_peekc(i)];
+            if (k == MPC_DISPATCH_NONE && i->suppress) { MPC_FAILURE(NULL); }
+            if (k != MPC_DISPATCH_NONE && k != MPC_DISPATCH_MANY) {
+              rs = mpc_frame_results(f);
+              rs[1].error = *e;
+              *e = NULL;
+              f->phase = 1;
+              f->dispatched = k-1;
+              MPC_CALL(p->data.or.xs[k-1]);
+            }
+          }
 
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+          MPC_CALL(p->data.or.xs[0]);
+
+        case MPC_TYPE_AND:
+          if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
+          mpc_frame_reserve(i, f, p->data.and.n);
+          mpc_input_mark(i);
+          MPC_CALL(p->data.and.xs[0]);
+
+        /* End */
+
+        default:
+          MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
       }
 
-   case MPC_TYPE_SEPBY1:
+    }
+
+    /* Returning to a parser from a sub-parser */
+
+    rs = mpc_frame_results(f);
+
+    switch (p->type) {
+
+      /* Application Parsers */
 
-      results = results_stk;
+      case MPC_TYPE_APPLY:
+        if (x) { MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, y.output)); }
+        else   { MPC_FAILURE(y.error); }
 
-      if(mpc_parse_run(i, p->data.sepby1.x, &results[j], e, depth+1)){
-        j++;
-        results = mpc_grow_results(i, j, results_stk, results);
+      case MPC_TYPE_APPLY_TO:
+        if (x) { MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, y.output, p->data.apply_to.d)); }
+        else   { MPC_FAILURE(y.error); }
 
-        while (
-          mpc_parse_run(i, p->data.sepby1.sep, &results[j], e, depth+1) &&
-          mpc_parse_run(i, p->data.sepby1.x, &results[j], e, depth+1)
-        ) {
-          j++;
-          results = mpc_grow_results(i, j, results_stk, results);
+      case MPC_TYPE_CHECK:
+        if (!x) { MPC_FAILURE(y.error); }
+        if (p->data.check.f(&y.output)) { MPC_SUCCESS(y.output); }
+        mpc_parse_dtor(i, p->data.check.dx, y.output);
+        MPC_FAILURE(mpc_err_fail(i, p->data.check.e));
+
+      case MPC_TYPE_CHECK_WITH:
+        if (!x) { MPC_FAILURE(y.error); }
+        if (p->data.check_with.f(&y.output, p->data.check_with.d)) { MPC_SUCCESS(y.output); }
+        mpc_parse_dtor(i, p->data.check_with.dx, y.output);
+        MPC_FAILURE(mpc_err_fail(i, p->data.check_with.e));
+
+      case MPC_TYPE_EXPECT:
+        mpc_input_suppress_disable(i);
+        if (x) { MPC_SUCCESS(y.output); }
+        else   { MPC_FAILURE(mpc_err_new(i, p->data.expect.m)); }
+
+      /*
+      ** A rule run without backtracking which fails after
+      ** consuming input is run again with backtracking so
+      ** the error is the same as it would have been. This
+      ** is left to the outermost such rule.
+      */
+
+      case MPC_TYPE_PREDICT:
+        if (f->phase == 0) {
+          mpc_input_backtrack_enable(i);
+          if (p->data.predict.restore) { i->commit--; }
         }
-      }
+        if (p->data.predict.restore) {
+          if (!x && f->phase == 0 && i->backtrack > 0 && i->state.pos != f->state.pos) {
+            mpc_input_rewind(i);
+            mpc_err_delete_internal(i, y.error);
+            mpc_input_mark(i);
+            f->phase = 1;
+            MPC_CALL(p->data.predict.x);
+          }
+          if (x) { mpc_input_unmark(i); } else { mpc_input_rewind(i); }
+        }
+        if (x) { MPC_SUCCESS(y.output); }
+        else   { MPC_FAILURE(y.error); }
 
-      if (j == 0) {
-        MPC_FAILURE(
-          mpc_err_many1(i, results[j].error);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
-        *e = mpc_err_merge(i, *e, results[j].error);
+      case MPC_TYPE_LAZY:
+        i->lazy--;
+        if (x) { MPC_SUCCESS(y.output); }
+        else   { MPC_FAILURE(y.error); }
 
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      }
+      case MPC_TYPE_ARENA:
+        if (x) { MPC_SUCCESS(y.output); }
+        else   { MPC_FAILURE(y.error); }
 
-    case MPC_TYPE_COUNT:
+      case MPC_TYPE_MEMO:
+        if (f->phase == 1) { mpc_parse_memo_store(i, f, x, &y); }
+        goto pop;
 
-      results = p->data.repeat.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n)
-        : results_stk;
+      /* Token Parsers */
 
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-        j++;
-        if (j == p->data.repeat.n) { break; }
-      }
+      case MPC_TYPE_TOKEN:
+        if (f->phase == 1) { i->discard--; }
+        if (!x) { MPC_FAILURE(y.error); }
+        if (f->phase == 1) { MPC_SUCCESS(mpc_input_slice(i, f->state.pos)); }
+        MPC_SUCCESS(y.output);
 
-      if (j == p->data.repeat.n) {
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
-        for (k = 0; k < j; k++) {
-          mpc_parse_dtor(i, p->data.repeat.dx, results[k].output);
+      case MPC_TYPE_SPAN:
+        if (p->data.span.token) { i->discard--; }
+        if (!x) { MPC_FAILURE(y.error); }
+        if (!p->data.span.token) { mpc_parse_dtor(i, p->data.span.dx, y.output); }
+        span = mpc_malloc(i, sizeof(mpc_span_t));
+        span->state = f->state;
+        span->length = i->state.pos - f->state.pos;
+        MPC_SUCCESS(span);
+
+      /* Optional Parsers */
+
+      /* TODO: Update Not Error Message */
+
+      case MPC_TYPE_NOT:
+        if (x) {
+          mpc_input_rewind(i);
+          mpc_input_suppress_disable(i);
+          mpc_parse_dtor(i, p->data.not.dx, y.output);
+          MPC_FAILURE(mpc_err_new(i, "opposite"));
+        } else {
+          mpc_input_unmark(i);
+          mpc_input_suppress_disable(i);
+          MPC_SUCCESS(i->discard ? NULL : p->data.not.lf());
         }
-        MPC_FAILURE(
-          mpc_err_count(i, results[j].error, p->data.repeat.n);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      }
 
-    /* Combinatory Parsers */
+      /*
+      ** Inside a rule found to be LL(1) a sub-parser that
+      ** fails after consuming input fails the whole choice
+      ** and the rule rewinds to where it started. A repeat
+      ** only does this when it can free what it collected.
+      */
+
+      case MPC_TYPE_MAYBE:
+        if (x) { MPC_SUCCESS(y.output); }
+        if (i->commit && i->state.pos != f->state.pos) { MPC_FAILURE(y.error); }
+        *e = mpc_err_merge(i, *e, y.error);
+        MPC_SUCCESS(i->discard ? NULL : p->data.not.lf());
+
+      /* Repeat Parsers */
+
+      case MPC_TYPE_MANY:
+      case MPC_TYPE_MANY1:
+
+        if (x) {
+          rs[f->j++] = y;
+          mpc_frame_reserve(i, f, f->j+1);
+          if (i->commit) { f->state = i->state; }
+          MPC_CALL(p->data.repeat.x);
+        }
 
-    case MPC_TYPE_OR:
+        if (i->commit && i->state.pos != f->state.pos
+        &&  (dx = mpc_fold_dtor(p->data.repeat.f))) {
+          for (k = 0; k < f->j; k++) { mpc_parse_dtor(i, dx, rs[k].output); }
+          MPC_FAILURE(y.error);
+        }
+
+        if (p->type == MPC_TYPE_MANY1 && f->j == 0) {
+          MPC_FAILURE(mpc_err_many1(i, y.error));
+        }
+
+        *e = mpc_err_merge(i, *e, y.error);
+        MPC_SUCCESS(mpc_parse_fold(i, p->data.repeat.f, f->j, (mpc_val_t**)rs));
 
-      if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
+      case MPC_TYPE_SEPBY1:
 
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
+        /* Phase 0 and 2 return from the item, phase 1 from the separator */
 
-      for (j = 0; j < p->data.or.n; j++) {
-        if (mpc_parse_run(i, p->data.or.xs[j], &results[j], e, depth+1)) {
-          MPC_SUCCESS(results[j].output;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+        if (x && f->phase != 1) {
+          rs[f->j++] = y;
+          mpc_frame_reserve(i, f, f->j+1);
+          f->phase = 1;
+          MPC_CALL(p->data.sepby1.sep);
+        }
+
+        if (x && f->phase == 1) {
+          f->phase = 2;
+          MPC_CALL(p->data.sepby1.x);
+        }
+
+        if (f->j == 0) {
+          MPC_FAILURE(mpc_err_many1(i, y.error));
+        }
+
+        *e = mpc_err_merge(i, *e, y.error);
+        MPC_SUCCESS(mpc_parse_fold(i, p->data.repeat.f, f->j, (mpc_val_t**)rs));
+
+      case MPC_TYPE_COUNT:
+
+        if (x) {
+          rs[f->j++] = y;
+          if (f->j == p->data.repeat.n) {
+            MPC_SUCCESS(mpc_parse_fold(i, p->data.repeat.f, f->j, (mpc_val_t**)rs));
+          }
+          MPC_CALL(p->data.repeat.x);
+        }
+
+        for (k = 0; k < f->j; k++) {
+          mpc_parse_dtor(i, p->data.repeat.dx, rs[k].output);
+        }
+        MPC_FAILURE(mpc_err_count(i, y.error, p->data.repeat.n));
+
+      /* Combinatory Parsers */
+
+      case MPC_TYPE_OR:
+
+        /*
+        ** If the dispatched alternative fails then no other
+        ** alternative can match either. Unless errors are
+        ** suppressed the rest are still run in order so the
+        ** error message is the same as without the table.
+        ** Whatever the dispatched alternative recorded is
+        ** kept with its error in rs[0] until its turn comes.
+        ** If the failure consumed input (no backtracking)
+        ** then earlier alternatives could only have failed
+        ** behind it, so the rerun starts after it.
+        */
+
+        if (f->phase == 1) {
+          rs[0].error = *e;
+          *e = rs[1].error;
+          if (x || i->suppress || (i->commit && i->state.pos != f->state.pos)) {
+            *e = mpc_err_merge(i, *e, rs[0].error);
+          } else {
+            y.error = mpc_err_merge(i, rs[0].error, y.error);
+          }
+        }
+
+        if (x) { MPC_SUCCESS(y.output); }
+        if (i->commit && i->state.pos != f->state.pos) { MPC_FAILURE(y.error); }
+
+        if (f->phase == 1 && i->suppress) {
+          MPC_FAILURE(y.error);
+        }
+
+        if (f->phase == 1) {
+          rs[0] = y;
+          f->phase = 2;
+          f->j = i->state.pos == f->state.pos ? -1 : f->dispatched-1;
         } else {
-          *e = mpc_err_merge(i, *e, results[j].error);
+          *e = mpc_err_merge(i, *e, y.error);
+        }
+
+        if (f->phase == 2 && f->j+1 == f->dispatched) {
+          *e = mpc_err_merge(i, *e, rs[0].error);
+          f->j++;
         }
-      }
 
-      MPC_FAILURE(NULL;
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+        if (++f->j < p->data.or.n) {
+          MPC_CALL(p->data.or.xs[f->j]);
+        }
 
-    case MPC_TYPE_AND:
-      if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
+        MPC_FAILURE(NULL);
 
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
+      case MPC_TYPE_AND:
 
-      mpc_input_mark(i);
-      for (j = 0; j < p->data.and.n; j++) {
-        if (!mpc_parse_run(i, p->data.and.xs[j], &results[j], e, depth+1)) {
+        if (!x) {
           mpc_input_rewind(i);
-          for (k = 0; k < j; k++) {
-            mpc_parse_dtor(i, p->data.and.dxs[k], results[k].output);
+          for (k = 0; k < f->j; k++) {
+            mpc_parse_dtor(i, p->data.and.dxs[k], rs[k].output);
           }
-          MPC_FAILURE(results[j].error;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+          MPC_FAILURE(y.error);
         }
-      }
-      mpc_input_unmark(i);
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.and.f, j, (mpc_val_t**)results);
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
 
-    /* End */
+        rs[f->j++] = y;
 
-    default:
+        if (f->j < p->data.and.n) {
+          MPC_CALL(p->data.and.xs[f->j]);
+        }
+
+        mpc_input_unmark(i);
+        MPC_SUCCESS(mpc_parse_fold(i, p->data.and.f, f->j, (mpc_val_t**)rs));
+
+      default:
+        MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
+    }
+
+    pop:
 
-      MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
+    if (f->results) { mpc_free(i, f->results); }
+    s.num--;
+    if (s.num == 0) { break; }
+    ret = 1;
   }
 
-  return 0;
+  i->frames = s.frames;
+  i->frames_slots = s.slots;
+
+  *r = y;
+  return x;
 
 }
 
 #undef MPC_SUCCESS
 #undef MPC_FAILURE
 #undef MPC_PRIMITIVE
+#undef MPC_CALL
 
 int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
   int x;
+  mpc_err_t *errs[3];
   mpc_err_t *e = mpc_err_fail(i, "Unknown Error");
   e->state = mpc_state_invalid();
-  x = mpc_parse_run(i, p, r, &e, 0);
+  x = mpc_parse_run(i, p, r, &e);
   if (x) {
     mpc_err_delete_internal(i, e);
     r->output = mpc_export(i, r->output);
+    /* Only an output the arena itself allocated can be its root */
+    if (i->arena && r->output && mpc_arena_owns(i->arena, r->output)) {
+      i->arena->root = r->output;
+      i->arena = NULL;
+    }
   } else {
-    r->error = mpc_err_export(i, mpc_err_merge(i, e, r->error));
+    errs[0] = e;
+    errs[1] = mpc_err_farthest(i);
+    errs[2] = r->error;
+    r->error = mpc_err_export(i, mpc_err_or(i, errs, 3));
   }
   return x;
 }
@@ -1361,8 +2544,13 @@ int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_res
 }
 
 int mpc_nparse(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
+  const char *end = memchr(string, '\0', length);
+  return mpc_parse_view(filename, string, end ? (size_t)(end - string) : length, p, r);
+}
+
+int mpc_parse_view(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
   int x;
-  mpc_input_t *i = mpc_input_new_nstring(filename, string, length);
+  mpc_input_t *i = mpc_input_new_view(filename, string, length);
   x = mpc_parse_input(i, p, r);
   mpc_input_delete(i);
   return x;
@@ -1370,7 +2558,8 @@ int mpc_nparse(const char *filename, const char *string, size_t length, mpc_pars
 
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
   int x;
-  mpc_input_t *i = mpc_input_new_file(filename, file);
+  mpc_input_t *i = mpc_input_new_mmap(filename, file);
+  if (i == NULL) { i = mpc_input_new_file(filename, file); }
   x = mpc_parse_input(i, p, r);
   mpc_input_delete(i);
   return x;
@@ -1400,6 +2589,54 @@ int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
   return res;
 }
 
+/*
+** Sessions
+**
+** A session keeps one input alive between parses.
+** Its filename, marks, memory pool, memo table and
+** frame stack are allocated once and reused, so
+** parsing many short strings does not pay to set
+** them up again each time.
+*/
+
+struct mpc_session_t {
+  mpc_input_t *input;
+  mpc_pool_stats_t stats;
+};
+
+mpc_session_t *mpc_session_new(void) {
+  mpc_session_t *s = malloc(sizeof(mpc_session_t));
+  s->input = mpc_input_new_string("<session>", "");
+  memset(&s->stats, 0, sizeof(mpc_pool_stats_t));
+  return s;
+}
+
+void mpc_session_delete(mpc_session_t *s) {
+  mpc_input_delete(s->input);
+  free(s);
+}
+
+int mpc_session_parse(mpc_session_t *s, const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+  return mpc_session_parse_view(s, filename, string, strlen(string), p, r);
+}
+
+int mpc_session_parse_view(mpc_session_t *s, const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_reuse(s->input, filename, string, length, MPC_INPUT_VIEW);
+  x = mpc_parse_input(s->input, p, r);
+  mpc_pool_stats_add(&s->stats, &s->input->pool.stats);
+  mpc_input_clear(s->input);
+  return x;
+}
+
+mpc_pool_stats_t mpc_session_pool_stats(mpc_session_t *s) {
+  return s->stats;
+}
+
+mpc_memo_stats_t mpc_session_memo_stats(mpc_session_t *s) {
+  return s->input->memo_stats;
+}
+
 /*
 ** Building a Parser
 */
@@ -1413,6 +2650,7 @@ static void mpc_undefine_or(mpc_parser_t *p) {
     mpc_undefine_unretained(p->data.or.xs[i], 0);
   }
   free(p->data.or.xs);
+  free(p->data.or.dispatch);
 
 }
 
@@ -1434,6 +2672,7 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
   switch (p->type) {
 
     case MPC_TYPE_FAIL: free(p->data.fail.m); break;
+    case MPC_TYPE_RUN: free(p->data.run.m); break;
 
     case MPC_TYPE_ONEOF:
     case MPC_TYPE_NONEOF:
@@ -1444,6 +2683,11 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
     case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
     case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
     case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
+    case MPC_TYPE_MEMO:     mpc_undefine_unretained(p->data.memo.x, 0);     break;
+    case MPC_TYPE_LAZY:     mpc_undefine_unretained(p->data.lazy.x, 0);     break;
+    case MPC_TYPE_ARENA:    mpc_undefine_unretained(p->data.arena.x, 0);    break;
+    case MPC_TYPE_TOKEN:
+    case MPC_TYPE_SPAN:     mpc_undefine_unretained(p->data.span.x, 0);     break;
 
     case MPC_TYPE_MAYBE:
     case MPC_TYPE_NOT:
@@ -1547,6 +2791,13 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       strcpy(p->data.fail.m, a->data.fail.m);
     break;
 
+    case MPC_TYPE_RUN:
+      if (a->data.run.m) {
+        p->data.run.m = malloc(strlen(a->data.run.m)+1);
+        strcpy(p->data.run.m, a->data.run.m);
+      }
+    break;
+
     case MPC_TYPE_ONEOF:
     case MPC_TYPE_NONEOF:
     case MPC_TYPE_STRING:
@@ -1557,6 +2808,12 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
     case MPC_TYPE_APPLY:    p->data.apply.x    = mpc_copy(a->data.apply.x);    break;
     case MPC_TYPE_APPLY_TO: p->data.apply_to.x = mpc_copy(a->data.apply_to.x); break;
     case MPC_TYPE_PREDICT:  p->data.predict.x  = mpc_copy(a->data.predict.x);  break;
+    case MPC_TYPE_LAZY:     p->data.lazy.x     = mpc_copy(a->data.lazy.x);     break;
+    case MPC_TYPE_ARENA:    p->data.arena.x    = mpc_copy(a->data.arena.x);    break;
+    case MPC_TYPE_TOKEN:
+    case MPC_TYPE_SPAN:     p->data.span.x     = mpc_copy(a->data.span.x);     break;
+
+    case MPC_TYPE_MEMO:     p->data.memo.x     = mpc_copy(a->data.memo.x);     break;
 
     case MPC_TYPE_MAYBE:
     case MPC_TYPE_NOT:
@@ -1585,6 +2842,10 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       for (i = 0; i < a->data.or.n; i++) {
         p->data.or.xs[i] = mpc_copy(a->data.or.xs[i]);
       }
+      if (a->data.or.dispatch) {
+        p->data.or.dispatch = malloc(256);
+        memcpy(p->data.or.dispatch, a->data.or.dispatch, 256);
+      }
     break;
     case MPC_TYPE_AND:
       p->data.and.xs = malloc(a->data.and.n * sizeof(mpc_parser_t*));
@@ -1808,6 +3069,7 @@ mpc_parser_t *mpc_range(char s, char e) {
   p->type = MPC_TYPE_RANGE;
   p->data.range.x = s;
   p->data.range.y = e;
+  mpc_class_range(p->data.range.set, s, e);
   return mpc_expectf(p, "character between '%c' and '%c'", s, e);
 }
 
@@ -1816,6 +3078,7 @@ mpc_parser_t *mpc_oneof(const char *s) {
   p->type = MPC_TYPE_ONEOF;
   p->data.string.x = malloc(strlen(s) + 1);
   strcpy(p->data.string.x, s);
+  mpc_class_oneof(p->data.string.set, s);
   return mpc_expectf(p, "one of '%s'", s);
 }
 
@@ -1824,6 +3087,7 @@ mpc_parser_t *mpc_noneof(const char *s) {
   p->type = MPC_TYPE_NONEOF;
   p->data.string.x = malloc(strlen(s) + 1);
   strcpy(p->data.string.x, s);
+  mpc_class_noneof(p->data.string.set, s);
   return mpc_expectf(p, "none of '%s'", s);
 
 }
@@ -1923,6 +3187,84 @@ mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_PREDICT;
   p->data.predict.x = a;
+  p->data.predict.restore = 0;
+  return p;
+}
+
+mpc_parser_t *mpc_lazy_errors(mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_LAZY;
+  p->data.lazy.x = a;
+  return p;
+}
+
+/*
+** A parser is token-like if its output is always a new
+** string of exactly the input it matched. Such a parser
+** can be run without building any output at all.
+*/
+
+static int mpc_tokenlike_unretained(mpc_parser_t *p, int force) {
+
+  int i;
+
+  if (p->retained && !force) { return 0; }
+
+  switch (p->type) {
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_SATISFY:
+    case MPC_TYPE_STRING:
+    case MPC_TYPE_RUN:
+    case MPC_TYPE_TOKEN:
+      return 1;
+    case MPC_TYPE_LIFT:    return p->data.lift.lf == mpcf_ctor_str;
+    case MPC_TYPE_EXPECT:  return mpc_tokenlike_unretained(p->data.expect.x, 0);
+    case MPC_TYPE_LAZY:    return mpc_tokenlike_unretained(p->data.lazy.x, 0);
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+      return p->data.not.lf == mpcf_ctor_str
+          && mpc_tokenlike_unretained(p->data.not.x, 0);
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      return p->data.repeat.f == mpcf_strfold
+          && mpc_tokenlike_unretained(p->data.repeat.x, 0);
+    case MPC_TYPE_OR:
+      if (p->data.or.n == 0) { return 0; }
+      for (i = 0; i < p->data.or.n; i++) {
+        if (!mpc_tokenlike_unretained(p->data.or.xs[i], 0)) { return 0; }
+      }
+      return 1;
+    case MPC_TYPE_AND:
+      if (p->data.and.f != mpcf_strfold) { return 0; }
+      for (i = 0; i < p->data.and.n; i++) {
+        if (!mpc_tokenlike_unretained(p->data.and.xs[i], 0)) { return 0; }
+      }
+      return 1;
+    default: return 0;
+  }
+
+}
+
+mpc_parser_t *mpc_span(mpc_parser_t *a, mpc_dtor_t da) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_SPAN;
+  p->data.span.x = a;
+  p->data.span.dx = da;
+  p->data.span.token = mpc_tokenlike_unretained(a, 0);
+  return p;
+}
+
+mpc_parser_t *mpc_memo(mpc_parser_t *a, mpc_dtor_t da, mpc_copy_t ca) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MEMO;
+  p->data.memo.x = a;
+  p->data.memo.dx = da;
+  p->data.memo.cx = ca;
   return p;
 }
 
@@ -1996,6 +3338,7 @@ mpc_parser_t *mpc_or(int n, ...) {
   p->type = MPC_TYPE_OR;
   p->data.or.n = n;
   p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.or.dispatch = NULL;
 
   va_start(va, n);
   for (i = 0; i < n; i++) {
@@ -2808,9 +4151,29 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
     free(s);
   }
 
+  if (p->type == MPC_TYPE_RUN && p->data.run.m) {
+    printf("%s%s", p->data.run.m, p->data.run.min ? "+" : "*");
+  }
+
+  if (p->type == MPC_TYPE_RUN && !p->data.run.m) {
+    e = calloc(256, 1);
+    for (i = 1; i < 256; i++) {
+      if (mpc_class_has(p->data.run.set, i)) { e[strlen(e)] = (char)i; }
+    }
+    s = mpcf_escape_new(e, mpc_escape_input_c, mpc_escape_output_c);
+    printf("[%s]%s", s, p->data.run.min ? "+" : "*");
+    free(s);
+    free(e);
+  }
+
   if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { mpc_print_unretained(p->data.memo.x, 0); }
+  if (p->type == MPC_TYPE_LAZY)     { mpc_print_unretained(p->data.lazy.x, 0); }
+  if (p->type == MPC_TYPE_ARENA)    { mpc_print_unretained(p->data.arena.x, 0); }
+  if (p->type == MPC_TYPE_TOKEN)    { mpc_print_unretained(p->data.span.x, 0); }
+  if (p->type == MPC_TYPE_SPAN)     { mpc_print_unretained(p->data.span.x, 0); }
 
   if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
   if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
@@ -2930,55 +4293,345 @@ int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
 }
 
 
+/*
+** Tags
+**
+** AST tags are interned in one table for the whole
+** process so each node points at a shared copy of its
+** tag rather than owning one. Each name between the
+** `|`s of a tag gets an id in order of first use and
+** every interned tag caches the mask of its ids. The
+** table is shared by every parse on every thread so
+** it is only touched while holding its lock.
+*/
+
+enum {
+  MPC_TAG_BITS = sizeof(unsigned long) * 8,
+  MPC_TAG_SLOTS_MIN = 64,
+  MPC_TAG_JOINS = 256
+};
+
+typedef struct {
+  char *tag;
+  unsigned long mask;
+} mpc_tag_t;
+
+static struct {
+  int slots;
+  int used;
+  mpc_tag_t *table;
+  int names_num;
+  char **names;
+} mpc_tags = { 0, 0, NULL, 0, NULL };
+
+#if defined(MPC_PTHREADS)
+static pthread_mutex_t mpc_tags_lock = PTHREAD_MUTEX_INITIALIZER;
+static void mpc_tags_acquire(void) { pthread_mutex_lock(&mpc_tags_lock); }
+static void mpc_tags_release(void) { pthread_mutex_unlock(&mpc_tags_lock); }
+#elif defined(MPC_WINTHREADS)
+static SRWLOCK mpc_tags_lock = SRWLOCK_INIT;
+static void mpc_tags_acquire(void) { AcquireSRWLockExclusive(&mpc_tags_lock); }
+static void mpc_tags_release(void) { ReleaseSRWLockExclusive(&mpc_tags_lock); }
+#else
+static void mpc_tags_acquire(void) { }
+static void mpc_tags_release(void) { }
+#endif
+
+static unsigned long mpc_tag_hash(const char *s) {
+  unsigned long h = 5381;
+  while (*s) { h = h * 33 + (unsigned char)*s; s++; }
+  return h;
+}
+
+static mpc_tag_t *mpc_tag_slot(const char *tag) {
+  unsigned long j = mpc_tag_hash(tag) & (unsigned long)(mpc_tags.slots - 1);
+  while (mpc_tags.table[j].tag && strcmp(mpc_tags.table[j].tag, tag) != 0) {
+    j = (j + 1) & (unsigned long)(mpc_tags.slots - 1);
+  }
+  return &mpc_tags.table[j];
+}
+
+static void mpc_tag_grow(void) {
+
+  int j;
+  mpc_tag_t *t, *old = mpc_tags.table;
+  int slots = mpc_tags.slots;
+
+  mpc_tags.slots = slots ? slots * 2 : MPC_TAG_SLOTS_MIN;
+  mpc_tags.table = calloc(mpc_tags.slots, sizeof(mpc_tag_t));
+
+  for (j = 0; j < slots; j++) {
+    if (old[j].tag == NULL) { continue; }
+    t = mpc_tag_slot(old[j].tag);
+    *t = old[j];
+  }
+
+  free(old);
+}
+
+/* Must be called holding the lock, as the entry returned moves when the table grows */
+
+static mpc_tag_t *mpc_tag_intern(const char *tag) {
+
+  mpc_tag_t *t;
+  unsigned long mask = 0;
+  const char *s, *e;
+  char *name;
+
+  if (mpc_tags.slots) {
+    t = mpc_tag_slot(tag);
+    if (t->tag) { return t; }
+  }
+
+  /* Intern the names of a compound tag first as that may grow the table */
+
+  if (strchr(tag, '|')) {
+    name = malloc(strlen(tag) + 1);
+    for (s = tag; *s; s = *e ? e + 1 : e) {
+      e = strchr(s, '|');
+      if (e == NULL) { e = s + strlen(s); }
+      if (e == s) { continue; }
+      memcpy(name, s, (size_t)(e - s));
+      name[e - s] = '\0';
+      mask |= mpc_tag_intern(name)->mask;
+    }
+    free(name);
+  }
+
+  if ((mpc_tags.used + 1) * 2 > mpc_tags.slots) { mpc_tag_grow(); }
+
+  t = mpc_tag_slot(tag);
+  t->tag = malloc(strlen(tag) + 1);
+  strcpy(t->tag, tag);
+  t->mask = mask;
+  mpc_tags.used++;
+
+  if (*tag && !strchr(tag, '|')) {
+    mpc_tags.names = realloc(mpc_tags.names, sizeof(char*) * (mpc_tags.names_num + 1));
+    mpc_tags.names[mpc_tags.names_num] = t->tag;
+    if (mpc_tags.names_num < MPC_TAG_BITS) { t->mask = 1UL << mpc_tags.names_num; }
+    mpc_tags.names_num++;
+  }
+
+  return t;
+}
+
+/*
+** Tags are mostly built by joining the same names onto
+** the same tags so each input caches the results by the
+** addresses of their parts, which saves taking the lock
+** and hashing the whole tag again for every node. Tags
+** built outside of a parse are not cached.
+*/
+
+struct mpc_tag_join_t {
+  const char *t;
+  size_t n;
+  const char *sep;
+  const char *from;
+  mpc_tag_t to;
+};
+
+static mpc_tag_join_t *mpc_input_joins(mpc_input_t *i) {
+  if (i->joins == NULL) { i->joins = calloc(MPC_TAG_JOINS, sizeof(mpc_tag_join_t)); }
+  return i->joins;
+}
+
+/* Returns the tag made of the first `n` bytes of `t`, then `sep`, then `from` */
+
+static mpc_tag_t mpc_tag_join(mpc_tag_join_t *c, const char *t, size_t n, const char *sep, const char *from) {
+
+  char buf[256];
+  char *s;
+  size_t l;
+  mpc_tag_t to;
+  mpc_tag_join_t *j = NULL;
+
+  if (c) {
+    j = &c[(((size_t)t >> 3) * 31 + ((size_t)from >> 3) + n) % MPC_TAG_JOINS];
+    if (j->t == t && j->n == n && j->sep == sep && j->from == from
+    &&  memcmp(j->to.tag, t, n) == 0) { return j->to; }
+  }
+
+  l = n + strlen(sep) + strlen(from) + 1;
+  s = l <= sizeof(buf) ? buf : malloc(l);
+  memcpy(s, t, n);
+  strcpy(s + n, sep);
+  strcat(s, from);
+
+  mpc_tags_acquire();
+  to = *mpc_tag_intern(s);
+  mpc_tags_release();
+
+  if (j) { j->t = t; j->n = n; j->sep = sep; j->from = from; j->to = to; }
+
+  if (s != buf) { free(s); }
+  return to;
+}
+
+int mpc_tag_id(const char *name) {
+
+  int j;
+  char *tag;
+
+  mpc_tags_acquire();
+  tag = mpc_tag_intern(name)->tag;
+  for (j = mpc_tags.names_num-1; j >= 0; j--) {
+    if (mpc_tags.names[j] == tag) { break; }
+  }
+  mpc_tags_release();
+
+  return j;
+}
+
+int mpc_ast_has_tag(mpc_ast_t *a, int id) {
+
+  const char *s, *e, *name = NULL;
+  size_t n;
+
+  if (id < 0) { return 0; }
+  if (id < MPC_TAG_BITS) { return (a->tag_mask >> id) & 1; }
+
+  mpc_tags_acquire();
+  if (id < mpc_tags.names_num) { name = mpc_tags.names[id]; }
+  mpc_tags_release();
+
+  if (name == NULL) { return 0; }
+
+  n = strlen(name);
+  for (s = a->tag; *s; s = *e ? e + 1 : e) {
+    e = strchr(s, '|');
+    if (e == NULL) { e = s + strlen(s); }
+    if ((size_t)(e - s) == n && memcmp(s, name, n) == 0) { return 1; }
+  }
+  return 0;
+}
+
 /*
 ** AST
+**
+** Child arrays keep spare slots and double when full,
+** so adding children one at a time is amortised.
 */
 
+enum { MPC_AST_CHILDREN_MIN = 4 };
+
+static mpc_ast_t *mpc_ast_own(mpc_ast_t *a);
+
+static mpc_ast_t *mpc_ast_set_tag(mpc_tag_join_t *c, mpc_ast_t *a, const char *t) {
+  mpc_tag_t i = mpc_tag_join(c, t, strlen(t), "", "");
+  a = mpc_ast_own(a);
+  a->tag = i.tag;
+  a->tag_mask = i.mask;
+  return a;
+}
+
 void mpc_ast_delete(mpc_ast_t *a) {
 
   int i;
 
   if (a == NULL) { return; }
+  if (--a->refs > 0) { return; }
+
+  if (a->arena) {
+    if (a->arena->root == a) { mpc_arena_delete(a->arena); }
+    return;
+  }
 
   for (i = 0; i < a->children_num; i++) {
     mpc_ast_delete(a->children[i]);
   }
 
   free(a->children);
-  free(a->tag);
   free(a->contents);
   free(a);
 
 }
 
+/* Drops a node whose children are being moved elsewhere, unless it is shared */
+
 static void mpc_ast_delete_no_children(mpc_ast_t *a) {
+  int i;
+  if (a->refs > 1) {
+    for (i = 0; i < a->children_num; i++) { a->children[i]->refs++; }
+    a->refs--;
+    return;
+  }
+  if (a->arena) { return; }
   free(a->children);
-  free(a->tag);
   free(a->contents);
   free(a);
 }
 
-mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
+/* A new node without a tag, in arena `m` or on the heap if that is NULL */
+
+static mpc_ast_t *mpc_ast_alloc(mpc_arena_t *m, const char *contents) {
 
-  mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
+  mpc_ast_t *a;
+  size_t cl = strlen(contents) + 1;
 
-  a->tag = malloc(strlen(tag) + 1);
-  strcpy(a->tag, tag);
+  if (m == NULL) {
+    a = malloc(sizeof(mpc_ast_t));
+    a->contents = malloc(cl);
+  } else {
+    a = mpc_arena_alloc(m, sizeof(mpc_ast_t) + cl);
+    a->contents = (char*)(a + 1);
+  }
 
-  a->contents = malloc(strlen(contents) + 1);
-  strcpy(a->contents, contents);
+  memcpy(a->contents, contents, cl);
 
   a->state = mpc_state_new();
 
   a->children_num = 0;
+  a->children_slots = 0;
   a->children = NULL;
+  a->arena = m;
+  a->refs = 1;
   return a;
 
 }
 
+static mpc_ast_t *mpc_ast_new_arena(mpc_arena_t *m, mpc_tag_join_t *c, const char *tag, const char *contents) {
+  return mpc_ast_set_tag(c, mpc_ast_alloc(m, contents), tag);
+}
+
+/*
+** Returns `a` if nothing else holds it, otherwise
+** drops its reference and returns a copy of the node
+** which shares the children, so only the node itself
+** is copied before it is changed.
+*/
+
+static mpc_ast_t *mpc_ast_own(mpc_ast_t *a) {
+
+  int i;
+  mpc_ast_t *r;
+
+  if (a->refs <= 1) { return a; }
+
+  r = mpc_ast_alloc(a->arena, a->contents);
+  r->tag = a->tag;
+  r->tag_mask = a->tag_mask;
+  r->state = a->state;
+
+  mpc_ast_reserve(r, a->children_num);
+  for (i = 0; i < a->children_num; i++) {
+    a->children[i]->refs++;
+    r->children[i] = a->children[i];
+  }
+  r->children_num = a->children_num;
+
+  a->refs--;
+  return r;
+}
+
+mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
+  return mpc_ast_new_arena(NULL, NULL, tag, contents);
+}
+
 mpc_ast_t *mpc_ast_build(int n, const char *tag, ...) {
 
-  mpc_ast_t *a = mpc_ast_new(tag, "");
+  mpc_ast_t *a = mpc_ast_reserve(mpc_ast_new(tag, ""), n);
 
   int i;
   va_list va;
@@ -2994,7 +4647,7 @@ mpc_ast_t *mpc_ast_build(int n, const char *tag, ...) {
 
 }
 
-mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a) {
+static mpc_ast_t *mpc_ast_root(mpc_tag_join_t *c, mpc_ast_t *a) {
 
   mpc_ast_t *r;
 
@@ -3002,11 +4655,15 @@ mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a) {
   if (a->children_num == 0) { return a; }
   if (a->children_num == 1) { return a; }
 
-  r = mpc_ast_new(">", "");
+  r = mpc_ast_new_arena(a->arena, c, ">", "");
   mpc_ast_add_child(r, a);
   return r;
 }
 
+mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a) {
+  return mpc_ast_root(NULL, a);
+}
+
 int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
 
   int i;
@@ -3022,38 +4679,79 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
   return 1;
 }
 
+mpc_ast_t *mpc_ast_reserve(mpc_ast_t *r, int n) {
+
+  mpc_ast_t **cs;
+
+  if (n <= r->children_slots) { return r; }
+
+  /* Arena child arrays are copied as arenas never free */
+
+  if (r->arena) {
+    cs = mpc_arena_alloc(r->arena, sizeof(mpc_ast_t*) * n);
+    if (r->children_num) { memcpy(cs, r->children, sizeof(mpc_ast_t*) * r->children_num); }
+    r->children = cs;
+  } else {
+    r->children = realloc(r->children, sizeof(mpc_ast_t*) * n);
+  }
+
+  r->children_slots = n;
+  return r;
+}
+
+static mpc_ast_t *mpc_ast_copy(mpc_arena_t *m, mpc_ast_t *a);
+
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
-  r->children_num++;
-  r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
-  r->children[r->children_num-1] = a;
+  mpc_ast_t *c;
+  r = mpc_ast_own(r);
+  /* A child kept elsewhere is copied in so a tree is freed as one */
+  if (a && a->arena != r->arena) {
+    c = mpc_ast_copy(r->arena, a);
+    mpc_ast_delete(a);
+    a = c;
+  }
+  if (r->children_num == r->children_slots) {
+    mpc_ast_reserve(r, r->children_slots ? r->children_slots * 2 : MPC_AST_CHILDREN_MIN);
+  }
+  r->children[r->children_num++] = a;
   return r;
 }
 
-mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
+static mpc_ast_t *mpc_ast_join_tag(mpc_tag_join_t *c, mpc_ast_t *a, const char *t) {
+  mpc_tag_t i;
   if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
-  memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
-  memmove(a->tag, t, strlen(t));
-  memmove(a->tag + strlen(t), "|", 1);
+  i = mpc_tag_join(c, t, strlen(t), "|", a->tag);
+  a = mpc_ast_own(a);
+  a->tag = i.tag;
+  a->tag_mask = i.mask;
   return a;
 }
 
-mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
+static mpc_ast_t *mpc_ast_join_root_tag(mpc_tag_join_t *c, mpc_ast_t *a, const char *t) {
+  mpc_tag_t i;
   if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, (strlen(t)-1) + strlen(a->tag) + 1);
-  memmove(a->tag + (strlen(t)-1), a->tag, strlen(a->tag)+1);
-  memmove(a->tag, t, (strlen(t)-1));
+  i = mpc_tag_join(c, t, strlen(t)-1, "", a->tag);
+  a = mpc_ast_own(a);
+  a->tag = i.tag;
+  a->tag_mask = i.mask;
   return a;
 }
 
+mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
+  return mpc_ast_join_tag(NULL, a, t);
+}
+
+mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
+  return mpc_ast_join_root_tag(NULL, a, t);
+}
+
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
-  a->tag = realloc(a->tag, strlen(t) + 1);
-  strcpy(a->tag, t);
-  return a;
+  return mpc_ast_set_tag(NULL, a, t);
 }
 
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s) {
   if (a == NULL) { return a; }
+  a = mpc_ast_own(a);
   a->state = s;
   return a;
 }
@@ -3260,18 +4958,27 @@ void mpc_ast_traverse_free(mpc_ast_trav_t **trav) {
   }
 }
 
-mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
+static mpc_val_t *mpc_ast_fold(mpc_arena_t *m, mpc_tag_join_t *c, int n, mpc_val_t **xs) {
 
   int i, j;
   mpc_ast_t** as = (mpc_ast_t**)xs;
-  mpc_ast_t *r;
+  mpc_ast_t *r, *a;
+  char *t;
 
   if (n == 0) { return NULL; }
   if (n == 1) { return xs[0]; }
   if (n == 2 && xs[1] == NULL) { return xs[0]; }
   if (n == 2 && xs[0] == NULL) { return xs[1]; }
 
-  r = mpc_ast_new(">", "");
+  r = mpc_ast_new_arena(m, c, ">", "");
+
+  /* Every child is known up front so the array is sized once */
+
+  for (i = 0, j = 0; i < n; i++) {
+    if (as[i] == NULL) { continue; }
+    j += as[i]->children_num >= 2 ? as[i]->children_num : 1;
+  }
+  mpc_ast_reserve(r, j);
 
   for (i = 0; i < n; i++) {
 
@@ -3280,9 +4987,13 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
     if        (as[i] && as[i]->children_num == 0) {
       mpc_ast_add_child(r, as[i]);
     } else if (as[i] && as[i]->children_num == 1) {
-      mpc_ast_add_child(r, mpc_ast_add_root_tag(as[i]->children[0], as[i]->tag));
+      a = as[i]->children[0];
+      t = as[i]->tag;
       mpc_ast_delete_no_children(as[i]);
+      mpc_ast_add_child(r, mpc_ast_join_root_tag(c, a, t));
     } else if (as[i] && as[i]->children_num >= 2) {
+      /* Children may be copied and freed as they move so the node must be ours */
+      as[i] = mpc_ast_own(as[i]);
       for (j = 0; j < as[i]->children_num; j++) {
         mpc_ast_add_child(r, as[i]->children[j]);
       }
@@ -3298,6 +5009,42 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
   return r;
 }
 
+mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
+  return mpc_ast_fold(NULL, NULL, n, xs);
+}
+
+/* Copies the whole tree into arena `m`, or onto the heap if that is NULL */
+
+static mpc_ast_t *mpc_ast_copy(mpc_arena_t *m, mpc_ast_t *a) {
+
+  int i;
+  mpc_ast_t *r = mpc_ast_alloc(m, a->contents);
+
+  r->tag = a->tag;
+  r->tag_mask = a->tag_mask;
+  r->state = a->state;
+
+  mpc_ast_reserve(r, a->children_num);
+  for (i = 0; i < a->children_num; i++) {
+    r->children[i] = a->children[i] ? mpc_ast_copy(m, a->children[i]) : NULL;
+  }
+  r->children_num = a->children_num;
+
+  return r;
+}
+
+mpc_val_t *mpcf_copy_ast(mpc_val_t *x) {
+  mpc_ast_t *a = x;
+  if (a == NULL) { return NULL; }
+  return mpc_ast_copy(a->arena, a);
+}
+
+mpc_val_t *mpcf_share_ast(mpc_val_t *x) {
+  mpc_ast_t *a = x;
+  if (a) { a->refs++; }
+  return a;
+}
+
 mpc_val_t *mpcf_str_ast(mpc_val_t *c) {
   mpc_ast_t *a = mpc_ast_new("", c);
   free(c);
@@ -3329,6 +5076,15 @@ mpc_parser_t *mpca_root(mpc_parser_t *a) {
   return mpc_apply(a, (mpc_apply_t)mpc_ast_add_root);
 }
 
+mpc_parser_t *mpca_arena(mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_ARENA;
+  p->data.arena.x = a;
+  return p;
+}
+
+mpc_parser_t *mpca_memo(mpc_parser_t *a) { return mpc_memo(a, (mpc_dtor_t)mpc_ast_delete, mpcf_share_ast); }
+
 mpc_parser_t *mpca_not(mpc_parser_t *a) { return mpc_not(a, (mpc_dtor_t)mpc_ast_delete); }
 mpc_parser_t *mpca_maybe(mpc_parser_t *a) { return mpc_maybe(a); }
 mpc_parser_t *mpca_many(mpc_parser_t *a) { return mpc_many(mpcf_fold_ast, a); }
@@ -3345,6 +5101,7 @@ mpc_parser_t *mpca_or(int n, ...) {
   p->type = MPC_TYPE_OR;
   p->data.or.n = n;
   p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.or.dispatch = NULL;
 
   va_start(va, n);
   for (i = 0; i < n; i++) {
@@ -3632,6 +5389,9 @@ mpc_parser_t *mpca_grammar_st(const char *grammar, mpca_grammar_st_t *st) {
 
   mpc_optimise(r.output);
 
+  if (st->flags & MPCA_LANG_PACKRAT) { r.output = mpca_memo(r.output); }
+  if (st->flags & MPCA_LANG_ARENA) { r.output = mpca_arena(r.output); }
+
   return (st->flags & MPCA_LANG_PREDICTIVE) ? mpc_predictive(r.output) : r.output;
 
 }
@@ -3700,20 +5460,51 @@ static void mpca_stmt_list_delete(mpc_val_t *x) {
 
 }
 
+static void mpc_dispatch_unretained(mpc_parser_t *p, int force);
+static void mpc_ll1_rules(mpc_parser_t **rules, int n);
+
 static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
 
   mpca_grammar_st_t *st = s;
   mpca_stmt_t *stmt;
   mpca_stmt_t **stmts = x;
   mpc_parser_t *left;
+  mpc_parser_t **rules;
+  int n;
+
+  while(*stmts) {
+    stmt = *stmts;
+    left = mpca_grammar_find_parser(stmt->ident, st);
+    if (left->name) { mpc_tag_id(left->name); }
+    if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
+    if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
+    if (st->flags & MPCA_LANG_LAZY_ERRORS) { stmt->grammar = mpc_lazy_errors(stmt->grammar); }
+    if (st->flags & MPCA_LANG_PACKRAT) { stmt->grammar = mpca_memo(stmt->grammar); }
+    if (st->flags & MPCA_LANG_ARENA) { stmt->grammar = mpca_arena(stmt->grammar); }
+    mpc_optimise(stmt->grammar);
+    mpc_define(left, stmt->grammar);
+    stmts++;
+  }
+
+  /* Without predictive mode each rule which is LL(1) is run as such */
+
+  if (!(st->flags & MPCA_LANG_PREDICTIVE)) {
+    stmts = x;
+    for (n = 0; stmts[n]; n++);
+    rules = malloc(sizeof(mpc_parser_t*) * (n ? n : 1));
+    for (n = 0; stmts[n]; n++) {
+      rules[n] = mpca_grammar_find_parser(stmts[n]->ident, st);
+    }
+    mpc_ll1_rules(rules, n);
+    free(rules);
+  }
 
+  /* Rules may refer to ones defined after them so rebuild dispatch tables */
+
+  stmts = x;
   while(*stmts) {
     stmt = *stmts;
-    left = mpca_grammar_find_parser(stmt->ident, st);
-    if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
-    if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
-    mpc_optimise(stmt->grammar);
-    mpc_define(left, stmt->grammar);
+    mpc_dispatch_unretained(mpca_grammar_find_parser(stmt->ident, st), 1);
     free(stmt->ident);
     free(stmt->name);
     free(stmt);
@@ -3807,7 +5598,8 @@ mpc_err_t *mpca_lang_file(int flags, FILE *f, ...) {
   st.parsers = NULL;
   st.flags = flags;
 
-  i = mpc_input_new_file("<mpca_lang_file>", f);
+  i = mpc_input_new_mmap("<mpca_lang_file>", f);
+  if (i == NULL) { i = mpc_input_new_file("<mpca_lang_file>", f); }
   err = mpca_lang_st(i, &st);
   mpc_input_delete(i);
 
@@ -3883,7 +5675,8 @@ mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
   st.parsers = NULL;
   st.flags = flags;
 
-  i = mpc_input_new_file(filename, f);
+  i = mpc_input_new_mmap(filename, f);
+  if (i == NULL) { i = mpc_input_new_file(filename, f); }
   err = mpca_lang_st(i, &st);
   mpc_input_delete(i);
 
@@ -3906,6 +5699,11 @@ static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { return 1 + mpc_nodecount_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { return 1 + mpc_nodecount_unretained(p->data.memo.x, 0); }
+  if (p->type == MPC_TYPE_LAZY)     { return 1 + mpc_nodecount_unretained(p->data.lazy.x, 0); }
+  if (p->type == MPC_TYPE_ARENA)    { return 1 + mpc_nodecount_unretained(p->data.arena.x, 0); }
+  if (p->type == MPC_TYPE_TOKEN)    { return 1 + mpc_nodecount_unretained(p->data.span.x, 0); }
+  if (p->type == MPC_TYPE_SPAN)     { return 1 + mpc_nodecount_unretained(p->data.span.x, 0); }
 
   if (p->type == MPC_TYPE_CHECK)    { return 1 + mpc_nodecount_unretained(p->data.check.x, 0); }
   if (p->type == MPC_TYPE_CHECK_WITH) { return 1 + mpc_nodecount_unretained(p->data.check_with.x, 0); }
@@ -3944,16 +5742,605 @@ static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
 
 }
 
+mpc_pool_stats_t mpc_pool_stats(void) {
+  mpc_pool_stats_t t;
+  t.hits = mpc_count_get(&mpc_pool_totals.hits);
+  t.misses = mpc_count_get(&mpc_pool_totals.misses);
+  t.fallbacks = mpc_count_get(&mpc_pool_totals.fallbacks);
+  return t;
+}
+
+void mpc_pool_stats_reset(void) {
+  mpc_count_clear(&mpc_pool_totals.hits);
+  mpc_count_clear(&mpc_pool_totals.misses);
+  mpc_count_clear(&mpc_pool_totals.fallbacks);
+}
+
 void mpc_stats(mpc_parser_t* p) {
   printf("Stats\n");
   printf("=====\n");
   printf("Node Count: %i\n", mpc_nodecount_unretained(p, 1));
+  printf("Memo Table Size: %lu bytes\n", (unsigned long)(MPC_INPUT_MEMO_NUM * sizeof(mpc_memo_t)));
+}
+
+/*
+** First Sets
+**
+** The first set of a parser is every byte it could
+** start by consuming. It is used to give each `or`
+** a table mapping the next byte to the alternative
+** which can match it, so the others need not be tried.
+*/
+
+enum {
+  MPC_FIRST_UNKNOWN  = -1,
+  MPC_FIRST_CONSUMES = 0,
+  MPC_FIRST_NULLABLE = 1,
+  MPC_FIRST_DEPTH_MAX = 64
+};
+
+static int mpc_first(mpc_parser_t *p, unsigned char *set, int depth) {
+
+  int j, k;
+
+  if (depth > MPC_FIRST_DEPTH_MAX) { return MPC_FIRST_UNKNOWN; }
+
+  switch (p->type) {
+
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SATISFY:
+      memset(set, 0xFF, 32);
+      return MPC_FIRST_CONSUMES;
+
+    case MPC_TYPE_SINGLE:
+      mpc_class_add(set, p->data.single.x);
+      return MPC_FIRST_CONSUMES;
+
+    case MPC_TYPE_RANGE:
+      for (k = 0; k < 32; k++) { set[k] |= p->data.range.set[k]; }
+      return MPC_FIRST_CONSUMES;
+
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+      for (k = 0; k < 32; k++) { set[k] |= p->data.string.set[k]; }
+      return MPC_FIRST_CONSUMES;
+
+    case MPC_TYPE_STRING:
+      if (p->data.string.x[0] == '\0') { return MPC_FIRST_NULLABLE; }
+      mpc_class_add(set, p->data.string.x[0]);
+      return MPC_FIRST_CONSUMES;
+
+    case MPC_TYPE_FAIL: return MPC_FIRST_CONSUMES;
+
+    case MPC_TYPE_RUN:
+      for (k = 0; k < 32; k++) { set[k] |= p->data.run.set[k]; }
+      return p->data.run.min ? MPC_FIRST_CONSUMES : MPC_FIRST_NULLABLE;
+
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_ANCHOR:
+    case MPC_TYPE_SOI:
+    case MPC_TYPE_EOI:
+    case MPC_TYPE_NOT:
+      return MPC_FIRST_NULLABLE;
+
+    case MPC_TYPE_EXPECT:     return mpc_first(p->data.expect.x, set, depth+1);
+    case MPC_TYPE_APPLY:      return mpc_first(p->data.apply.x, set, depth+1);
+    case MPC_TYPE_APPLY_TO:   return mpc_first(p->data.apply_to.x, set, depth+1);
+    case MPC_TYPE_CHECK:      return mpc_first(p->data.check.x, set, depth+1);
+    case MPC_TYPE_CHECK_WITH: return mpc_first(p->data.check_with.x, set, depth+1);
+    case MPC_TYPE_PREDICT:    return mpc_first(p->data.predict.x, set, depth+1);
+    case MPC_TYPE_MEMO:       return mpc_first(p->data.memo.x, set, depth+1);
+    case MPC_TYPE_LAZY:       return mpc_first(p->data.lazy.x, set, depth+1);
+    case MPC_TYPE_ARENA:      return mpc_first(p->data.arena.x, set, depth+1);
+    case MPC_TYPE_TOKEN:
+    case MPC_TYPE_SPAN:       return mpc_first(p->data.span.x, set, depth+1);
+    case MPC_TYPE_MANY1:      return mpc_first(p->data.repeat.x, set, depth+1);
+    case MPC_TYPE_SEPBY1:     return mpc_first(p->data.sepby1.x, set, depth+1);
+
+    case MPC_TYPE_MAYBE:
+      k = mpc_first(p->data.not.x, set, depth+1);
+      return k == MPC_FIRST_UNKNOWN ? k : MPC_FIRST_NULLABLE;
+
+    case MPC_TYPE_MANY:
+      k = mpc_first(p->data.repeat.x, set, depth+1);
+      return k == MPC_FIRST_UNKNOWN ? k : MPC_FIRST_NULLABLE;
+
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.n == 0) { return MPC_FIRST_NULLABLE; }
+      return mpc_first(p->data.repeat.x, set, depth+1);
+
+    case MPC_TYPE_OR:
+      if (p->data.or.n == 0) { return MPC_FIRST_NULLABLE; }
+      j = MPC_FIRST_CONSUMES;
+      for (k = 0; k < p->data.or.n; k++) {
+        switch (mpc_first(p->data.or.xs[k], set, depth+1)) {
+          case MPC_FIRST_UNKNOWN: return MPC_FIRST_UNKNOWN;
+          case MPC_FIRST_NULLABLE: j = MPC_FIRST_NULLABLE; break;
+          default: break;
+        }
+      }
+      return j;
+
+    case MPC_TYPE_AND:
+      for (k = 0; k < p->data.and.n; k++) {
+        j = mpc_first(p->data.and.xs[k], set, depth+1);
+        if (j != MPC_FIRST_NULLABLE) { return j; }
+      }
+      return MPC_FIRST_NULLABLE;
+
+    default: return MPC_FIRST_UNKNOWN;
+  }
+
+}
+
+static void mpc_optimise_dispatch(mpc_parser_t *p) {
+
+  int i, c, unique = 0;
+  unsigned char set[32];
+  unsigned char *table;
+
+  free(p->data.or.dispatch);
+  p->data.or.dispatch = NULL;
+
+  if (p->data.or.n < 2 || p->data.or.n >= MPC_DISPATCH_MANY) { return; }
+
+  table = calloc(256, 1);
+
+  for (i = 0; i < p->data.or.n; i++) {
+    memset(set, 0, sizeof(set));
+    if (mpc_first(p->data.or.xs[i], set, 0) != MPC_FIRST_CONSUMES) {
+      free(table);
+      return;
+    }
+    for (c = 0; c < 256; c++) {
+      if (!mpc_class_has(set, c)) { continue; }
+      table[c] = table[c] == MPC_DISPATCH_NONE ? i+1 : MPC_DISPATCH_MANY;
+    }
+  }
+
+  for (c = 0; c < 256; c++) {
+    if (table[c] != MPC_DISPATCH_NONE && table[c] != MPC_DISPATCH_MANY) { unique = 1; }
+  }
+
+  if (unique) { p->data.or.dispatch = table; }
+  else { free(table); }
+
+}
+
+static void mpc_dispatch_unretained(mpc_parser_t *p, int force) {
+
+  int i;
+
+  if (p->retained && !force) { return; }
+
+  switch (p->type) {
+    case MPC_TYPE_EXPECT:     mpc_dispatch_unretained(p->data.expect.x, 0); break;
+    case MPC_TYPE_APPLY:      mpc_dispatch_unretained(p->data.apply.x, 0); break;
+    case MPC_TYPE_APPLY_TO:   mpc_dispatch_unretained(p->data.apply_to.x, 0); break;
+    case MPC_TYPE_PREDICT:    mpc_dispatch_unretained(p->data.predict.x, 0); break;
+    case MPC_TYPE_CHECK:      mpc_dispatch_unretained(p->data.check.x, 0); break;
+    case MPC_TYPE_CHECK_WITH: mpc_dispatch_unretained(p->data.check_with.x, 0); break;
+    case MPC_TYPE_MEMO:       mpc_dispatch_unretained(p->data.memo.x, 0); break;
+    case MPC_TYPE_LAZY:       mpc_dispatch_unretained(p->data.lazy.x, 0); break;
+    case MPC_TYPE_ARENA:      mpc_dispatch_unretained(p->data.arena.x, 0); break;
+    case MPC_TYPE_TOKEN:
+    case MPC_TYPE_SPAN:       mpc_dispatch_unretained(p->data.span.x, 0); break;
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:      mpc_dispatch_unretained(p->data.not.x, 0); break;
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:      mpc_dispatch_unretained(p->data.repeat.x, 0); break;
+    case MPC_TYPE_SEPBY1:
+      mpc_dispatch_unretained(p->data.sepby1.x, 0);
+      mpc_dispatch_unretained(p->data.sepby1.sep, 0);
+      break;
+    case MPC_TYPE_OR:
+      for (i = 0; i < p->data.or.n; i++) { mpc_dispatch_unretained(p->data.or.xs[i], 0); }
+      mpc_optimise_dispatch(p);
+      break;
+    case MPC_TYPE_AND:
+      for (i = 0; i < p->data.and.n; i++) { mpc_dispatch_unretained(p->data.and.xs[i], 0); }
+      break;
+    default: break;
+  }
+
+}
+
+/*
+** LL(1) Rules
+**
+** A rule which can always decide what to do from the
+** next byte gives the same result whether or not the
+** input is rewound when a part of it fails. Such rules
+** are run without backtracking, rewinding only once at
+** the rule itself, which saves saving and restoring the
+** input at every sequence, string and choice inside.
+**
+** A part is "clean" if it can only fail before consuming
+** anything, and "total" if it cannot fail at all. A part
+** which fails after consuming is still harmless if no
+** other choice or what follows could start with what it
+** consumed, as then the backtracking parse fails too.
+*/
+
+static int mpc_ll1_clean(mpc_parser_t *p, int depth);
+
+static mpc_parser_t *mpc_ll1_inner(mpc_parser_t *p) {
+  switch (p->type) {
+    case MPC_TYPE_EXPECT:   return p->data.expect.x;
+    case MPC_TYPE_APPLY:    return p->data.apply.x;
+    case MPC_TYPE_APPLY_TO: return p->data.apply_to.x;
+    case MPC_TYPE_MEMO:     return p->data.memo.x;
+    case MPC_TYPE_LAZY:     return p->data.lazy.x;
+    case MPC_TYPE_ARENA:    return p->data.arena.x;
+    case MPC_TYPE_TOKEN:
+    case MPC_TYPE_SPAN:     return p->data.span.x;
+    default: return NULL;
+  }
+}
+
+static int mpc_ll1_restores(mpc_parser_t *p) {
+  return p->type == MPC_TYPE_PREDICT && p->data.predict.restore;
+}
+
+static int mpc_ll1_total(mpc_parser_t *p, int depth) {
+
+  int k;
+
+  if (depth > MPC_FIRST_DEPTH_MAX || p->retained) { return 0; }
+
+  switch (p->type) {
+
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_STATE:
+      return 1;
+
+    case MPC_TYPE_RUN: return p->data.run.min == 0;
+
+    case MPC_TYPE_MAYBE: return mpc_ll1_clean(p->data.not.x, depth+1);
+    case MPC_TYPE_MANY:  return mpc_ll1_clean(p->data.repeat.x, depth+1);
+    case MPC_TYPE_COUNT: return p->data.repeat.n == 0;
+
+    case MPC_TYPE_AND:
+      for (k = 0; k < p->data.and.n; k++) {
+        if (!mpc_ll1_total(p->data.and.xs[k], depth+1)) { return 0; }
+      }
+      return 1;
+
+    default:
+      return mpc_ll1_inner(p) ? mpc_ll1_total(mpc_ll1_inner(p), depth+1) : 0;
+  }
+
+}
+
+static int mpc_ll1_clean(mpc_parser_t *p, int depth) {
+
+  int j, k, consumed;
+  unsigned char set[32];
+
+  if (depth > MPC_FIRST_DEPTH_MAX) { return 0; }
+  if (p->retained) { return mpc_ll1_restores(p); }
+
+  switch (p->type) {
+
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_SATISFY:
+    case MPC_TYPE_FAIL:
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_ANCHOR:
+    case MPC_TYPE_SOI:
+    case MPC_TYPE_EOI:
+      return 1;
+
+    case MPC_TYPE_STRING: return strlen(p->data.string.x) <= 1;
+    case MPC_TYPE_RUN:    return p->data.run.min <= 1;
+    case MPC_TYPE_PREDICT: return p->data.predict.restore;
+
+    case MPC_TYPE_MAYBE: return mpc_ll1_clean(p->data.not.x, depth+1);
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1: return mpc_ll1_clean(p->data.repeat.x, depth+1);
+
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.n == 0) { return 1; }
+      return p->data.repeat.n == 1 && mpc_ll1_clean(p->data.repeat.x, depth+1);
+
+    case MPC_TYPE_OR:
+      for (k = 0; k < p->data.or.n; k++) {
+        if (!mpc_ll1_clean(p->data.or.xs[k], depth+1)) { return 0; }
+      }
+      return 1;
+
+    /* Once a part may have consumed input the rest must not fail */
+
+    case MPC_TYPE_AND:
+      consumed = 0;
+      for (k = 0; k < p->data.and.n; k++) {
+        if (consumed) {
+          if (!mpc_ll1_total(p->data.and.xs[k], depth+1)) { return 0; }
+          continue;
+        }
+        if (!mpc_ll1_clean(p->data.and.xs[k], depth+1)) { return 0; }
+        memset(set, 0, sizeof(set));
+        if (mpc_first(p->data.and.xs[k], set, 0) == MPC_FIRST_UNKNOWN) { return 0; }
+        for (j = 0; j < 32; j++) { consumed = consumed || set[j]; }
+      }
+      return 1;
+
+    default:
+      return mpc_ll1_inner(p) ? mpc_ll1_clean(mpc_ll1_inner(p), depth+1) : 0;
+  }
+
+}
+
+static int mpc_ll1_disjoint(const unsigned char *a, const unsigned char *b) {
+  int k;
+  for (k = 0; k < 32; k++) { if (a[k] & b[k]) { return 0; } }
+  return 1;
+}
+
+/*
+** Can a failure of `x` after consuming input be left for
+** the parts which follow it, whose first set is `follow`,
+** to fail on? Not if those parts may match nothing, as
+** then what follows the rule is not known.
+*/
+
+static int mpc_ll1_recovers(mpc_parser_t *x, const unsigned char *follow, int open) {
+  unsigned char set[32];
+  if (mpc_ll1_clean(x, 0)) { return 1; }
+  if (open) { return 0; }
+  memset(set, 0, sizeof(set));
+  if (mpc_first(x, set, 0) == MPC_FIRST_UNKNOWN) { return 0; }
+  return mpc_ll1_disjoint(set, follow);
+}
+
+typedef struct {
+  mpc_parser_t **rules;
+  int *safe;
+  int n;
+} mpc_ll1_t;
+
+static int mpc_ll1_safe(mpc_ll1_t *g, mpc_parser_t *p,
+  const unsigned char *follow, int open, int depth, int force) {
+
+  int j, k, r;
+  unsigned char set[32], next[32], other[32];
+
+  if (depth > MPC_FIRST_DEPTH_MAX) { return 0; }
+
+  if (p->retained && !force) {
+    if (mpc_ll1_restores(p)) { return 1; }
+    for (k = 0; k < g->n; k++) {
+      if (g->rules[k] == p) { return g->safe[k]; }
+    }
+    return 0;
+  }
+
+  switch (p->type) {
+
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_SATISFY:
+    case MPC_TYPE_STRING:
+    case MPC_TYPE_RUN:
+    case MPC_TYPE_FAIL:
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_ANCHOR:
+    case MPC_TYPE_SOI:
+    case MPC_TYPE_EOI:
+      return 1;
+
+    case MPC_TYPE_PREDICT: return p->data.predict.restore;
+
+    case MPC_TYPE_MAYBE:
+      return mpc_ll1_recovers(p->data.not.x, follow, open)
+        && mpc_ll1_safe(g, p->data.not.x, follow, open, depth+1, 0);
+
+    /* A repeat can only drop what it collected if it knows how to free it */
+
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      if (p->type == MPC_TYPE_COUNT && p->data.repeat.n == 0) { return 1; }
+      memset(set, 0, sizeof(set));
+      if (mpc_first(p->data.repeat.x, set, 0) == MPC_FIRST_UNKNOWN) { return 0; }
+      for (k = 0; k < 32; k++) { set[k] |= follow[k]; }
+      if (p->type != MPC_TYPE_COUNT) {
+        if (!mpc_ll1_clean(p->data.repeat.x, 0) && !mpc_fold_dtor(p->data.repeat.f)) { return 0; }
+        if (!mpc_ll1_recovers(p->data.repeat.x, follow, open)) { return 0; }
+      }
+      return mpc_ll1_safe(g, p->data.repeat.x, set, open, depth+1, 0);
+
+    /* A failed choice must rule out every later one */
+
+    case MPC_TYPE_OR:
+      for (k = 0; k < p->data.or.n; k++) {
+        if (!mpc_ll1_safe(g, p->data.or.xs[k], follow, open, depth+1, 0)) { return 0; }
+        if (k == p->data.or.n-1 || mpc_ll1_clean(p->data.or.xs[k], 0)) { continue; }
+        memset(set, 0, sizeof(set));
+        if (mpc_first(p->data.or.xs[k], set, 0) == MPC_FIRST_UNKNOWN) { return 0; }
+        for (j = k+1; j < p->data.or.n; j++) {
+          memset(other, 0, sizeof(other));
+          if (mpc_first(p->data.or.xs[j], other, 0) != MPC_FIRST_CONSUMES) { return 0; }
+          if (!mpc_ll1_disjoint(set, other)) { return 0; }
+        }
+      }
+      return 1;
+
+    /* Each part is followed by the first sets of those after it */
+
+    case MPC_TYPE_AND:
+      memcpy(next, follow, sizeof(next));
+      for (k = p->data.and.n-1; k >= 0; k--) {
+        if (!mpc_ll1_safe(g, p->data.and.xs[k], next, open, depth+1, 0)) { return 0; }
+        memset(set, 0, sizeof(set));
+        r = mpc_first(p->data.and.xs[k], set, 0);
+        if (r == MPC_FIRST_UNKNOWN) { return 0; }
+        if (r == MPC_FIRST_CONSUMES) { memset(next, 0, sizeof(next)); open = 0; }
+        for (j = 0; j < 32; j++) { next[j] |= set[j]; }
+      }
+      return 1;
+
+    default:
+      return mpc_ll1_inner(p) ? mpc_ll1_safe(g, mpc_ll1_inner(p), follow, open, depth+1, 0) : 0;
+  }
+
+}
+
+/*
+** Assumes every rule is LL(1) and drops those that turn out
+** not to be until none change, then has each remaining rule
+** run without backtracking. Memo tables, arenas and lazy
+** errors are kept outside so they still see the whole rule.
+*/
+
+static void mpc_ll1_rules(mpc_parser_t **rules, int n) {
+
+  int k, changed;
+  unsigned char none[32];
+  mpc_parser_t *q, *t;
+  mpc_ll1_t g;
+
+  g.rules = rules;
+  g.safe = malloc(sizeof(int) * n);
+  g.n = n;
+  for (k = 0; k < n; k++) { g.safe[k] = 1; }
+  memset(none, 0, sizeof(none));
+
+  do {
+    changed = 0;
+    for (k = 0; k < n; k++) {
+      if (g.safe[k] && !mpc_ll1_safe(&g, rules[k], none, 1, 0, 1)) {
+        g.safe[k] = 0;
+        changed = 1;
+      }
+    }
+  } while (changed);
+
+  for (k = 0; k < n; k++) {
+    if (!g.safe[k]) { continue; }
+    q = rules[k];
+    while (q->type == MPC_TYPE_ARENA || q->type == MPC_TYPE_MEMO || q->type == MPC_TYPE_LAZY) {
+      q = mpc_ll1_inner(q);
+    }
+    t = mpc_undefined();
+    t->type = q->type;
+    t->data = q->data;
+    q->type = MPC_TYPE_PREDICT;
+    q->data.predict.x = t;
+    q->data.predict.restore = 1;
+  }
+
+  free(g.safe);
+
+}
+
+/*
+** Wraps the outermost token-like sequences and repeats
+** so their text is copied out of the input once instead
+** of being folded together a character at a time.
+*/
+
+static void mpc_token_unretained(mpc_parser_t *p, int force) {
+
+  int i;
+  mpc_parser_t *t;
+
+  if (p->retained && !force) { return; }
+
+  switch (p->type) {
+    case MPC_TYPE_EXPECT:     mpc_token_unretained(p->data.expect.x, 0); break;
+    case MPC_TYPE_APPLY:      mpc_token_unretained(p->data.apply.x, 0); break;
+    case MPC_TYPE_APPLY_TO:   mpc_token_unretained(p->data.apply_to.x, 0); break;
+    case MPC_TYPE_PREDICT:    mpc_token_unretained(p->data.predict.x, 0); break;
+    case MPC_TYPE_CHECK:      mpc_token_unretained(p->data.check.x, 0); break;
+    case MPC_TYPE_CHECK_WITH: mpc_token_unretained(p->data.check_with.x, 0); break;
+    case MPC_TYPE_MEMO:       mpc_token_unretained(p->data.memo.x, 0); break;
+    case MPC_TYPE_LAZY:       mpc_token_unretained(p->data.lazy.x, 0); break;
+    case MPC_TYPE_ARENA:      mpc_token_unretained(p->data.arena.x, 0); break;
+    case MPC_TYPE_SPAN:       mpc_token_unretained(p->data.span.x, 0); break;
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:      mpc_token_unretained(p->data.not.x, 0); break;
+    case MPC_TYPE_SEPBY1:
+      mpc_token_unretained(p->data.sepby1.x, 0);
+      mpc_token_unretained(p->data.sepby1.sep, 0);
+      break;
+    case MPC_TYPE_OR:
+      for (i = 0; i < p->data.or.n; i++) { mpc_token_unretained(p->data.or.xs[i], 0); }
+      break;
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+    case MPC_TYPE_AND:
+      if (mpc_tokenlike_unretained(p, 1)) {
+        t = mpc_undefined();
+        t->type = p->type;
+        t->data = p->data;
+        p->type = MPC_TYPE_TOKEN;
+        p->data.span.x = t;
+        p->data.span.dx = free;
+        p->data.span.token = 1;
+        break;
+      }
+      if (p->type == MPC_TYPE_AND) {
+        for (i = 0; i < p->data.and.n; i++) { mpc_token_unretained(p->data.and.xs[i], 0); }
+      } else {
+        mpc_token_unretained(p->data.repeat.x, 0);
+      }
+      break;
+    default: break;
+  }
+
+}
+
+/*
+** Finds the class of a chain of expects ending in a single
+** character class parser, none of which are retained.
+*/
+
+static int mpc_optimise_run_class(mpc_parser_t *p, unsigned char *set) {
+
+  while (p->type == MPC_TYPE_EXPECT && !p->retained) { p = p->data.expect.x; }
+
+  if (p->retained) { return 0; }
+
+  switch (p->type) {
+    case MPC_TYPE_SINGLE:
+      memset(set, 0, 32);
+      mpc_class_add(set, p->data.single.x);
+      return 1;
+    case MPC_TYPE_RANGE:  memcpy(set, p->data.range.set, 32); return 1;
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF: memcpy(set, p->data.string.set, 32); return 1;
+    default: return 0;
+  }
+
 }
 
 static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
 
   int i, n, m;
   mpc_parser_t *t;
+  unsigned char set[32];
+  char *s;
 
   if (p->retained && !force) { return; }
 
@@ -3965,6 +6352,11 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_CHECK)      { mpc_optimise_unretained(p->data.check.x, 0); }
   if (p->type == MPC_TYPE_CHECK_WITH) { mpc_optimise_unretained(p->data.check_with.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)    { mpc_optimise_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)       { mpc_optimise_unretained(p->data.memo.x, 0); }
+  if (p->type == MPC_TYPE_LAZY)       { mpc_optimise_unretained(p->data.lazy.x, 0); }
+  if (p->type == MPC_TYPE_ARENA)      { mpc_optimise_unretained(p->data.arena.x, 0); }
+  if (p->type == MPC_TYPE_TOKEN)      { mpc_optimise_unretained(p->data.span.x, 0); }
+  if (p->type == MPC_TYPE_SPAN)       { mpc_optimise_unretained(p->data.span.x, 0); }
   if (p->type == MPC_TYPE_NOT)        { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MAYBE)      { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MANY)       { mpc_optimise_unretained(p->data.repeat.x, 0); }
@@ -4000,7 +6392,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       p->data.or.n = n + m - 1;
       p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
       memmove(p->data.or.xs + n - 1, t->data.or.xs, m * sizeof(mpc_parser_t*));
-      free(t->data.or.xs); free(t->name); free(t);
+      free(t->data.or.xs); free(t->data.or.dispatch); free(t->name); free(t);
       continue;
     }
 
@@ -4014,7 +6406,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
       memmove(p->data.or.xs + m, p->data.or.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
       memmove(p->data.or.xs, t->data.or.xs, m * sizeof(mpc_parser_t*));
-      free(t->data.or.xs); free(t->name); free(t);
+      free(t->data.or.xs); free(t->data.or.dispatch); free(t->name); free(t);
       continue;
     }
 
@@ -4117,6 +6509,25 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       continue;
     }
 
+    /* Fuse re `many` of class */
+    if ((p->type == MPC_TYPE_MANY || p->type == MPC_TYPE_MANY1)
+    &&  p->data.repeat.f == mpcf_strfold
+    &&  mpc_optimise_run_class(p->data.repeat.x, set)) {
+      t = p->data.repeat.x;
+      s = NULL;
+      if (t->type == MPC_TYPE_EXPECT) {
+        s = malloc(strlen(t->data.expect.m) + 1);
+        strcpy(s, t->data.expect.m);
+      }
+      m = p->type == MPC_TYPE_MANY1;
+      mpc_delete(t);
+      p->type = MPC_TYPE_RUN;
+      memcpy(p->data.run.set, set, 32);
+      p->data.run.m = s;
+      p->data.run.min = m;
+      continue;
+    }
+
     return;
 
   }
@@ -4125,5 +6536,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
 
 void mpc_optimise(mpc_parser_t *p) {
   mpc_optimise_unretained(p, 1);
+  mpc_token_unretained(p, 1);
+  mpc_dispatch_unretained(p, 1);
 }
 
@@ -67,16 +67,37 @@ typedef struct mpc_parser_t mpc_parser_t;
 
 int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
 int mpc_nparse(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r);
+int mpc_parse_view(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
 
+/*
+** Sessions
+**
+** A session holds the buffers used while parsing
+** so they can be reused across many calls, which
+** saves setting them up for every short input.
+** A session should only be used by one thread at
+** a time.
+*/
+
+struct mpc_session_t;
+typedef struct mpc_session_t mpc_session_t;
+
+mpc_session_t *mpc_session_new(void);
+void mpc_session_delete(mpc_session_t *s);
+
+int mpc_session_parse(mpc_session_t *s, const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
+int mpc_session_parse_view(mpc_session_t *s, const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r);
+
 /*
 ** Function Types
 */
 
 typedef void(*mpc_dtor_t)(mpc_val_t*);
 typedef mpc_val_t*(*mpc_ctor_t)(void);
+typedef mpc_val_t*(*mpc_copy_t)(mpc_val_t*);
 
 typedef mpc_val_t*(*mpc_apply_t)(mpc_val_t*);
 typedef mpc_val_t*(*mpc_apply_to_t)(mpc_val_t*,void*);
@@ -148,6 +169,39 @@ mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...);
 
 mpc_parser_t *mpc_predictive(mpc_parser_t *a);
 
+/*
+** Lazy errors. While `a` runs only the farthest failure
+** is recorded and the error is built once the parse as a
+** whole fails. Repetition prefixes such as "one or more
+** of" are not included in the message.
+*/
+mpc_parser_t *mpc_lazy_errors(mpc_parser_t *a);
+
+/*
+** Packrat memoisation. Results of `a` are cached per input
+** position for the duration of one parse. `ca` must return a
+** copy of a value without consuming it, `da` must delete one.
+** Rather than copy, `ca` may return the value itself with a
+** reference taken, as `mpcf_share_ast` does for ASTs.
+*/
+mpc_parser_t *mpc_memo(mpc_parser_t *a, mpc_dtor_t da, mpc_copy_t ca);
+
+/*
+** Spans. Returns where in the input `a` matched rather
+** than its output. When `a` only ever returns the text it
+** matched (characters, strings, regular expressions and
+** their `mpcf_strfold` combinations) no text is built at
+** all; otherwise its output is deleted with `da`. The
+** result is freed with `free`.
+*/
+
+typedef struct {
+  mpc_state_t state;
+  long length;
+} mpc_span_t;
+
+mpc_parser_t *mpc_span(mpc_parser_t *a, mpc_dtor_t da);
+
 /*
 ** Common Parsers
 */
@@ -282,23 +336,52 @@ mpc_parser_t *mpc_re_mode(const char *re, int mode);
 ** AST
 */
 
+struct mpc_arena_t;
+typedef struct mpc_arena_t mpc_arena_t;
+
+/*
+** `tag` is borrowed: it points into a table of interned
+** tags that lives for the rest of the process and is
+** shared between nodes. Code that frees, reallocates or
+** writes into `a->tag` corrupts every node sharing it;
+** use `mpc_ast_tag` and `mpc_ast_add_tag` to change it.
+** Each name in a tag has an id from `mpc_tag_id` and
+** `tag_mask` has a bit set for each of the first ids a
+** tag contains; `mpc_ast_has_tag` tests for any id.
+**
+** Nodes are reference counted so that packrat parsers
+** can share results. `mpc_ast_delete` drops a reference.
+** The functions that change a node first copy it if it
+** is shared, so always use the node they return.
+*/
+
 typedef struct mpc_ast_t {
   char *tag;
   char *contents;
   mpc_state_t state;
   int children_num;
+  int children_slots;
   struct mpc_ast_t** children;
+  mpc_arena_t *arena;
+  unsigned long tag_mask;
+  int refs;
 } mpc_ast_t;
 
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents);
 mpc_ast_t *mpc_ast_build(int n, const char *tag, ...);
 mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a);
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a);
+
+/* Makes room for `n` children so adding up to `n` does not reallocate */
+mpc_ast_t *mpc_ast_reserve(mpc_ast_t *r, int n);
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s);
 
+int mpc_tag_id(const char *name);
+int mpc_ast_has_tag(mpc_ast_t *a, int id);
+
 void mpc_ast_delete(mpc_ast_t *a);
 void mpc_ast_print(mpc_ast_t *a);
 void mpc_ast_print_to(mpc_ast_t *a, FILE *fp);
@@ -335,12 +418,23 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b);
 mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **as);
 mpc_val_t *mpcf_str_ast(mpc_val_t *c);
 mpc_val_t *mpcf_state_ast(int n, mpc_val_t **xs);
+mpc_val_t *mpcf_copy_ast(mpc_val_t *x);
+mpc_val_t *mpcf_share_ast(mpc_val_t *x);
 
 mpc_parser_t *mpca_tag(mpc_parser_t *a, const char *t);
 mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t);
 mpc_parser_t *mpca_root(mpc_parser_t *a);
 mpc_parser_t *mpca_state(mpc_parser_t *a);
 mpc_parser_t *mpca_total(mpc_parser_t *a);
+mpc_parser_t *mpca_memo(mpc_parser_t *a);
+
+/*
+** Arena ASTs. Once `a` starts running every AST node built
+** for the rest of the parse is allocated from one arena.
+** `mpc_ast_delete` on the root of the result releases the
+** whole tree at once and does nothing on any other node.
+*/
+mpc_parser_t *mpca_arena(mpc_parser_t *a);
 
 mpc_parser_t *mpca_not(mpc_parser_t *a);
 mpc_parser_t *mpca_maybe(mpc_parser_t *a);
@@ -355,11 +449,19 @@ mpc_parser_t *mpca_and(int n, ...);
 enum {
   MPCA_LANG_DEFAULT              = 0,
   MPCA_LANG_PREDICTIVE           = 1,
-  MPCA_LANG_WHITESPACE_SENSITIVE = 2
+  MPCA_LANG_WHITESPACE_SENSITIVE = 2,
+  MPCA_LANG_PACKRAT              = 4,
+  MPCA_LANG_LAZY_ERRORS          = 8,
+  MPCA_LANG_ARENA                = 16
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);
 
+/*
+** Unless `MPCA_LANG_PREDICTIVE` is given, each rule defined
+** by `mpca_lang` which can be shown to be LL(1) is run
+** without backtracking. Results and errors are unchanged.
+*/
 mpc_err_t *mpca_lang(int flags, const char *language, ...);
 mpc_err_t *mpca_lang_file(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_pipe(int flags, FILE *f, ...);
@@ -374,6 +476,40 @@ void mpc_print(mpc_parser_t *p);
 void mpc_optimise(mpc_parser_t *p);
 void mpc_stats(mpc_parser_t *p);
 
+/*
+** Allocations made while parsing come from a pool
+** of size classes. When each parse finishes its
+** counts of allocations served by the pool, those
+** that missed because the pool was full, and those
+** too large for any class are added to the totals of
+** its session, if any, and to those of the process.
+** The process totals may be read from any thread.
+*/
+
+typedef struct {
+  long hits;
+  long misses;
+  long fallbacks;
+} mpc_pool_stats_t;
+
+mpc_pool_stats_t mpc_pool_stats(void);
+void mpc_pool_stats_reset(void);
+mpc_pool_stats_t mpc_session_pool_stats(mpc_session_t *s);
+
+/*
+** Counts of packrat memo lookups that found a result,
+** those that did not, and results that replaced another
+** in the table, for the last parse run by a session.
+*/
+
+typedef struct {
+  long hits;
+  long misses;
+  long evictions;
+} mpc_memo_stats_t;
+
+mpc_memo_stats_t mpc_session_memo_stats(mpc_session_t *s);
+
 int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
   int(*tester)(const void*, const void*),
   mpc_dtor_t destructor,